@@ -6,19 +6,31 @@
 #include<linux/fs.h>       // For file operations structure and functions
 #include<linux/err.h>      // For error handling macros
 #include<linux/kdev_t.h>   // For device number macros
+#include<linux/cdev.h>     // For the character device structure
+#include<linux/moduleparam.h> // For module parameters
+#include<linux/slab.h>     // For kcalloc
+
+/* Tracepoints for the file operations, see crdevfile_trace.h */
+#define CREATE_TRACE_POINTS
+#include "crdevfile_trace.h"
 
 /* Macro definitions */
 #define DYNAMIC 1            // Set to 1 for dynamic device number allocation
 #define DEVICE_NAME "new_device" // Name of the device
 #define MAJOR_NUM 255        // Major number for static allocation
 #define MINOR_NUM 0          // Minor number for static allocation
+#define MAX_DEVS 8192        // Largest number of device nodes
 
 /* Global variables */
-static dev_t dev_num;         // Device number (for static allocation)
+static dev_t dev_num;         // First device number of the range
 static struct class *dev_class; // Pointer to device class
-static struct device *dev_device; // Pointer to device structure
+static struct cdev dev_cdev;  // One cdev serves every minor of the range
+static struct device **dev_devices; // Device of each minor, unregistered directly on removal
 
-static int major_num;         // Major number for dynamic allocation
+/* Number of device nodes, /dev/new_device0 .. /dev/new_device<nr_devs - 1> */
+static unsigned int nr_devs = 1;
+module_param(nr_devs, uint, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(nr_devs, "Number of device nodes (default 1, max 8192)");
 
 /* Function prototypes for file operations */
 static int dev_open(struct inode *, struct file *);         // Open function
@@ -40,11 +52,14 @@ static struct file_operations fops =
 static int __init hello_world_init(void)
 {
     int ret;
+    unsigned int i;
+
+    nr_devs = clamp_t(unsigned int, nr_devs, 1, MAX_DEVS);
 
 #if DYNAMIC
-    /* Dynamic device number allocation */
-    major_num = register_chrdev(0, DEVICE_NAME, &fops);
-    if (major_num < 0)
+    /* Dynamic allocation of a range of nr_devs device numbers */
+    ret = alloc_chrdev_region(&dev_num, 0, nr_devs, DEVICE_NAME);
+    if (ret < 0)
     {
         pr_err("Failed to register device number dynamically\n");
         return ret;
@@ -52,7 +67,7 @@ static int __init hello_world_init(void)
 #else
     /* Static device number allocation */
     dev_num = MKDEV(MAJOR_NUM, MINOR_NUM);
-    ret = register_chrdev_region(dev_num, 1, DEVICE_NAME);
+    ret = register_chrdev_region(dev_num, nr_devs, DEVICE_NAME);
     if (ret < 0)
     {
         pr_err("Failed to register static device number\n");
@@ -61,74 +76,106 @@ static int __init hello_world_init(void)
     pr_info("Static allocation Major:%d Minor:%d\n", MAJOR(dev_num), MINOR(dev_num));
 #endif
 
+    /* Register the file operations for the whole range at once */
+    cdev_init(&dev_cdev, &fops);
+    dev_cdev.owner = THIS_MODULE;
+    ret = cdev_add(&dev_cdev, dev_num, nr_devs);
+    if (ret < 0)
+    {
+        pr_err("Failed to add the cdev\n");
+        goto cdev_fail;
+    }
+
     /* Creating struct class for the device */
     dev_class = class_create("new_class");
     if (IS_ERR(dev_class))
     {
         pr_err("Unable to create the class\n");
+        ret = PTR_ERR(dev_class);
         goto class_fail;
     }
 
-    /* Creating the device */
-    dev_device = device_create(dev_class, NULL, MKDEV(major_num, 0), NULL, "new_device");
-    if (IS_ERR(dev_device))
+    dev_devices = kcalloc(nr_devs, sizeof(*dev_devices), GFP_KERNEL);
+    if (!dev_devices)
     {
-        pr_err("Failed to create the device\n");
-        goto device_fail;
+        ret = -ENOMEM;
+        goto array_fail;
     }
 
-    printk(KERN_INFO "Kernel Module Inserted Successfully...\n");
+    /* Creating the device nodes */
+    for (i = 0; i < nr_devs; i++)
+    {
+        dev_devices[i] = device_create(dev_class, NULL, dev_num + i, NULL, DEVICE_NAME "%u", i);
+        if (IS_ERR(dev_devices[i]))
+        {
+            pr_err("Failed to create the device\n");
+            ret = PTR_ERR(dev_devices[i]);
+            goto device_fail;
+        }
+    }
+
+    printk(KERN_INFO "Kernel Module Inserted Successfully (%u devices)...\n", nr_devs);
     return 0;
 
 device_fail:
-    /* Cleanup class if device creation fails */
+    /* Cleanup the devices created so far and the class */
+    while (i--)
+        device_unregister(dev_devices[i]);
+    kfree(dev_devices);
+array_fail:
     class_destroy(dev_class);
 class_fail:
-    /* Unregister the device number on failure */
-    unregister_chrdev(major_num, DEVICE_NAME);
-    return -1;
+    cdev_del(&dev_cdev);
+cdev_fail:
+    /* Unregister the device numbers on failure */
+    unregister_chrdev_region(dev_num, nr_devs);
+    return ret;
 }
 
 /* Device open function implementation */
 static int dev_open(struct inode *inodep, struct file *filep)
 {
-    printk(KERN_INFO "New Device file open function called\n");
+    trace_crdevfile_open(0);
     return 0; // Return 0 to indicate success
 }
 
 /* Device read function implementation */
 static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
 {
-    printk(KERN_INFO "New Device file read function called\n");
+    trace_crdevfile_read(len, *offset, 0);
     return 0; // Return 0 for now as no data is being read
 }
 
 /* Device write function implementation */
 static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset)
 {
-    printk(KERN_INFO "New Device file write function called\n");
+    trace_crdevfile_write(len, *offset, 0);
     return 0; // Return 0 for now as no data is being written
 }
 
 /* Device release function implementation */
 static int dev_release(struct inode *inodep, struct file *filep)
 {
-    printk(KERN_INFO "New Device file release function called\n");
+    trace_crdevfile_release(0);
     return 0; // Return 0 to indicate success
 }
 
 /* Module cleanup function */
 static void __exit hello_world_exit(void)
 {
-    /* Cleanup created device */
-    device_destroy(dev_class, MKDEV(major_num, 0));
+    unsigned int i;
+
+    /* Cleanup created devices */
+    for (i = 0; i < nr_devs; i++)
+        device_unregister(dev_devices[i]);
+    kfree(dev_devices);
 
     /* Cleanup device class */
-    class_unregister(dev_class);
     class_destroy(dev_class);
 
-    /* Unregister the device number */
-    unregister_chrdev(major_num, DEVICE_NAME);
+    /* Remove the cdev and unregister the device numbers */
+    cdev_del(&dev_cdev);
+    unregister_chrdev_region(dev_num, nr_devs);
 
     printk(KERN_INFO "Module Removed Successfully...\n");
 }
@@ -0,0 +1,718 @@
+/* Scriptable throughput/latency benchmark for the chrdrv device */
+/*       GCC command to build the application
+        # gcc -O2 -pthread -o chrbench chrbench.c
+
+   Runs every combination of the given message sizes, writer counts and
+   reader counts for a fixed time and prints one CSV row or JSON object per
+   run, for example
+
+        # ./chrbench --path rw,readv,io_uring --sizes 64,4096 --writers 1,4 \
+                     --readers 1,4 --duration 2 --format csv > run.csv
+
+   Paths:
+        rw        one write()/read() per message
+        readv     writev()/readv() of --batch messages per call
+        io_uring  --batch IORING_OP_WRITE/READ requests per submission
+        mmap      user space producer/consumer on the shared mapping
+                  (one writer and one reader only, no system calls)
+        fwd_rw    readers forward every message to --sink with read() + write()
+        splice    readers forward to --sink with splice() through a pipe,
+                  without copying the data through user space
+
+   Writers use write() on the fwd_rw and splice paths, so the two compare
+   what a forwarder costs, for example
+
+        # ./chrbench --path fwd_rw,splice --sizes 4096,65536 --sink /tmp/out
+
+   Latency is measured per call (per batch for readv and io_uring) and
+   reported separately for writers and readers as p50/p99/p999 in ns.
+*/
+
+#define _GNU_SOURCE // pthread_tryjoin_np
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "chrdrv.h"
+
+#define DEVICE_PATH "/dev/new_device0"
+#define MAX_LIST 16 // Longest --sizes/--writers/--readers list
+#define MAX_BATCH 64 // Largest --batch
+#define HIST_SUB_BITS 4 // Histogram resolution: 16 sub-buckets per power of two
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+enum bench_path { PATH_RW, PATH_READV, PATH_IO_URING, PATH_MMAP, PATH_FWD_RW, PATH_SPLICE, NR_PATHS };
+
+static const char *const path_names[] = { "rw", "readv", "io_uring", "mmap", "fwd_rw", "splice" };
+
+/* Latency histogram: log2 buckets split into 2^HIST_SUB_BITS linear sub-buckets */
+struct hist {
+    unsigned long long count[HIST_BUCKETS];
+    unsigned long long total;
+};
+
+/* Command line configuration */
+static struct {
+    const char *dev;
+    const char *sink; // Where forwarding readers send the data
+    int paths[NR_PATHS], nr_paths;
+    size_t sizes[MAX_LIST];
+    int nr_sizes;
+    int writers[MAX_LIST], nr_writers;
+    int readers[MAX_LIST], nr_readers;
+    int batch;
+    double duration;
+    int json;
+    __u32 mode;
+} cfg = {
+    .dev = DEVICE_PATH,
+    .sink = "/dev/null",
+    .batch = 8,
+    .duration = 2.0,
+    .mode = CHRDRV_MODE_STREAM,
+};
+
+/* State of one benchmark run */
+struct run {
+    enum bench_path path;
+    size_t size;
+    volatile int stop_writers;
+    volatile int stop_readers;
+    void *map; // mmap path: whole mapping
+    size_t map_len;
+};
+
+/* One writer or reader thread */
+struct worker {
+    struct run *run;
+    int fd;
+    int sink; // Forwarding readers: output file
+    int pipe[2]; // splice path: pipe between the device and the sink
+    int is_writer;
+    unsigned long long ops; // Messages moved
+    unsigned long long bytes; // Bytes moved
+    int failed;
+    struct hist hist; // Per call latency
+};
+
+/* Monotonic time in nanoseconds */
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Account one latency sample */
+static void hist_add(struct hist *h, unsigned long long ns)
+{
+    int msb = ns ? 63 - __builtin_clzll(ns) : 0;
+    unsigned int sub;
+
+    if (msb < HIST_SUB_BITS)
+        sub = ns; // Small values are exact
+    else
+        sub = (ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    h->count[(msb << HIST_SUB_BITS) | sub]++;
+    h->total++;
+}
+
+/* Lower bound of the values in bucket i */
+static unsigned long long hist_value(int i)
+{
+    int msb = i >> HIST_SUB_BITS;
+    unsigned long long sub = i & ((1 << HIST_SUB_BITS) - 1);
+
+    if (msb < HIST_SUB_BITS)
+        return sub;
+    return (1ULL << msb) | (sub << (msb - HIST_SUB_BITS));
+}
+
+/* Value below which fraction q of the samples fall */
+static unsigned long long hist_percentile(const struct hist *h, double q)
+{
+    unsigned long long want = (unsigned long long)(h->total * q);
+    unsigned long long seen = 0;
+    int i;
+
+    if (!h->total)
+        return 0;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen > want)
+            return hist_value(i);
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->count[i] += src->count[i];
+    dst->total += src->total;
+}
+
+/* Minimal io_uring instance driven through the raw system calls */
+struct uring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+};
+
+static int uring_init(struct uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    size_t sq_len, cq_len;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0)
+        return -1;
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP && cq_len > sq_len)
+        sq_len = cq_len;
+    sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              u->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        return -1;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  u->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            return -1;
+    }
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        return -1;
+
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+/*
+ * Submit n reads or writes of size bytes each and wait for all of them.
+ * Returns the bytes moved or -1 on error.
+ */
+static long long uring_batch(struct uring *u, int fd, int write_op, char *buf,
+                             size_t size, int n)
+{
+    unsigned tail = *u->sq_tail;
+    long long bytes = 0;
+    int i, done = 0;
+
+    for (i = 0; i < n; i++) {
+        unsigned idx = (tail + i) & *u->sq_mask;
+        struct io_uring_sqe *sqe = &u->sqes[idx];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = write_op ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (unsigned long)(buf + i * size);
+        sqe->len = size;
+        sqe->off = -1; // Current file position; the device is a stream
+        u->sq_array[idx] = idx;
+    }
+    __atomic_store_n(u->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+    if (syscall(__NR_io_uring_enter, u->fd, n, n, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        return -1;
+
+    while (done < n) {
+        unsigned head = *u->cq_head;
+
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE) && done < n) {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+
+            if (cqe->res < 0) {
+                errno = -cqe->res;
+                bytes = -1;
+            } else if (bytes >= 0) {
+                bytes += cqe->res;
+            }
+            head++;
+            done++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        if (done < n &&
+            syscall(__NR_io_uring_enter, u->fd, 0, n - done, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+            return -1;
+    }
+    return bytes;
+}
+
+/* Copy n bytes into or out of the mapped ring at position pos */
+static void ring_copy(unsigned char *data, __u32 size, __u32 pos, char *buf, size_t n, int put)
+{
+    __u32 off = pos & (size - 1);
+    size_t first = n < size - off ? n : size - off;
+
+    if (put) {
+        memcpy(data + off, buf, first);
+        memcpy(data, buf + first, n - first);
+    } else {
+        memcpy(buf, data + off, first);
+        memcpy(buf + first, data, n - first);
+    }
+}
+
+/*
+ * One message through the mapping. Spins (yielding) while the ring is full
+ * or empty; returns 0 once the run is stopped.
+ */
+static size_t mmap_op(struct worker *w, char *buf)
+{
+    struct chrdrv_ctrl *ctrl = w->run->map;
+    unsigned char *data = (unsigned char *)w->run->map + ctrl->data_offset;
+    size_t size = w->run->size;
+    volatile int *stop = w->is_writer ? &w->run->stop_writers : &w->run->stop_readers;
+
+    while (!*stop) {
+        __u32 head, tail;
+
+        if (w->is_writer) {
+            head = __atomic_load_n(&ctrl->head, __ATOMIC_RELAXED);
+            tail = __atomic_load_n(&ctrl->tail, __ATOMIC_ACQUIRE);
+            if (ctrl->size - (head - tail) >= size) {
+                ring_copy(data, ctrl->size, head, buf, size, 1);
+                __atomic_store_n(&ctrl->head, head + size, __ATOMIC_RELEASE);
+                return size;
+            }
+        } else {
+            tail = __atomic_load_n(&ctrl->tail, __ATOMIC_RELAXED);
+            head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+            if (head - tail >= size) {
+                ring_copy(data, ctrl->size, tail, buf, size, 0);
+                __atomic_store_n(&ctrl->tail, tail + size, __ATOMIC_RELEASE);
+                return size;
+            }
+        }
+        sched_yield();
+    }
+    return 0;
+}
+
+/*
+ * splice path reader: move up to size bytes from the device into the pipe,
+ * then all of them on to the sink. Returns the bytes moved or -1.
+ */
+static long long splice_fwd(struct worker *w, size_t size)
+{
+    ssize_t n, m, left;
+
+    n = splice(w->fd, NULL, w->pipe[1], NULL, size, SPLICE_F_MOVE);
+    for (left = n; left > 0; left -= m) {
+        m = splice(w->pipe[0], NULL, w->sink, NULL, left, SPLICE_F_MOVE);
+        if (m <= 0)
+            return -1;
+    }
+    return n;
+}
+
+/* fwd_rw path reader: read() one message and write() it to the sink */
+static long long rw_fwd(struct worker *w, char *buf, size_t size)
+{
+    ssize_t n = read(w->fd, buf, size);
+
+    if (n > 0 && write(w->sink, buf, n) != n)
+        return -1;
+    return n;
+}
+
+/* Writer or reader thread body */
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct run *run = w->run;
+    int batch = run->path == PATH_READV || run->path == PATH_IO_URING ? cfg.batch : 1;
+    volatile int *stop = w->is_writer ? &run->stop_writers : &run->stop_readers;
+    struct iovec iov[MAX_BATCH];
+    struct uring u = { .fd = -1 };
+    char *buf;
+    int i;
+
+    buf = calloc(batch, run->size);
+    if (!buf) {
+        w->failed = 1;
+        return NULL;
+    }
+    for (i = 0; i < batch; i++) {
+        iov[i].iov_base = buf + i * run->size;
+        iov[i].iov_len = run->size;
+    }
+    if (run->path == PATH_IO_URING && uring_init(&u, MAX_BATCH) < 0) {
+        perror("io_uring_setup");
+        w->failed = 1;
+        free(buf);
+        return NULL;
+    }
+    pthread_cleanup_push(free, buf); // Readers may be cancelled in read()
+
+    while (!*stop) {
+        unsigned long long start = now_ns();
+        long long n;
+
+        switch (run->path) {
+        case PATH_RW:
+            n = w->is_writer ? write(w->fd, buf, run->size) : read(w->fd, buf, run->size);
+            break;
+        case PATH_READV:
+            n = w->is_writer ? writev(w->fd, iov, batch) : readv(w->fd, iov, batch);
+            break;
+        case PATH_IO_URING:
+            n = uring_batch(&u, w->fd, w->is_writer, buf, run->size, batch);
+            break;
+        case PATH_FWD_RW:
+            n = w->is_writer ? write(w->fd, buf, run->size) : rw_fwd(w, buf, run->size);
+            break;
+        case PATH_SPLICE:
+            n = w->is_writer ? write(w->fd, buf, run->size) : splice_fwd(w, run->size);
+            break;
+        default:
+            n = mmap_op(w, buf);
+            break;
+        }
+        if (n < 0) {
+            perror(w->is_writer ? "write" : "read");
+            w->failed = 1;
+            break;
+        }
+        hist_add(&w->hist, now_ns() - start);
+        w->bytes += n;
+        w->ops += (n + run->size - 1) / run->size;
+    }
+
+    if (run->path == PATH_IO_URING)
+        close(u.fd);
+    pthread_cleanup_pop(1); // Frees buf
+    return NULL;
+}
+
+/* Print one result, as a CSV row or a JSON object */
+static void report(struct run *run, int nw, int nr, double secs,
+                   unsigned long long ops, unsigned long long bytes,
+                   const struct hist *wh, const struct hist *rh, int first)
+{
+    const char *fmt_csv = "%s,%zu,%d,%d,%.0f,%.2f,%llu,%llu,%llu,%llu,%llu,%llu\n";
+    const char *fmt_json =
+        "%s  {\"path\": \"%s\", \"size\": %zu, \"writers\": %d, \"readers\": %d, "
+        "\"ops_per_sec\": %.0f, \"mb_per_sec\": %.2f, "
+        "\"write_p50_ns\": %llu, \"write_p99_ns\": %llu, \"write_p999_ns\": %llu, "
+        "\"read_p50_ns\": %llu, \"read_p99_ns\": %llu, \"read_p999_ns\": %llu}";
+
+    if (cfg.json)
+        printf(fmt_json, first ? "" : ",\n", path_names[run->path], run->size, nw, nr,
+               ops / secs, bytes / secs / 1e6,
+               hist_percentile(wh, 0.50), hist_percentile(wh, 0.99), hist_percentile(wh, 0.999),
+               hist_percentile(rh, 0.50), hist_percentile(rh, 0.99), hist_percentile(rh, 0.999));
+    else
+        printf(fmt_csv, path_names[run->path], run->size, nw, nr,
+               ops / secs, bytes / secs / 1e6,
+               hist_percentile(wh, 0.50), hist_percentile(wh, 0.99), hist_percentile(wh, 0.999),
+               hist_percentile(rh, 0.50), hist_percentile(rh, 0.99), hist_percentile(rh, 0.999));
+    fflush(stdout);
+}
+
+/* Run nw writers against nr readers on one path and message size */
+static int run_one(enum bench_path path, size_t size, int nw, int nr, int first)
+{
+    struct run run = { .path = path, .size = size };
+    struct worker *w = calloc(nw + nr, sizeof(*w));
+    pthread_t *tid = calloc(nw + nr, sizeof(*tid));
+    struct hist *wh = calloc(1, sizeof(*wh));
+    struct hist *rh = calloc(1, sizeof(*rh));
+    unsigned long long start, elapsed, ops = 0, bytes = 0;
+    int ctl, kick, i, started = 0, failed = -1;
+
+    if (!w || !tid || !wh || !rh)
+        goto out;
+    for (i = 0; i < nw + nr; i++)
+        w[i].fd = w[i].sink = w[i].pipe[0] = w[i].pipe[1] = -1;
+
+    ctl = open(cfg.dev, O_RDWR);
+    if (ctl < 0 || ioctl(ctl, CHRDRV_IOC_SET_MODE, &cfg.mode) < 0) {
+        perror(cfg.dev);
+        if (ctl >= 0)
+            close(ctl);
+        goto out;
+    }
+    close(ctl);
+
+    if (path == PATH_MMAP) {
+        long page = sysconf(_SC_PAGESIZE);
+        int fd = open(cfg.dev, O_RDWR);
+        struct chrdrv_ctrl *c;
+
+        if (fd < 0) {
+            perror(cfg.dev);
+            goto out;
+        }
+        c = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+        if (c == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            goto out;
+        }
+        run.map_len = page + c->size;
+        munmap(c, page);
+        run.map = mmap(NULL, run.map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (run.map == MAP_FAILED) {
+            perror("mmap");
+            run.map = NULL;
+            goto out;
+        }
+    }
+
+    for (i = 0; i < nw + nr; i++) {
+        w[i].run = &run;
+        w[i].is_writer = i < nw;
+        w[i].fd = open(cfg.dev, w[i].is_writer ? O_WRONLY : O_RDONLY);
+        if (w[i].fd < 0) {
+            perror(cfg.dev);
+            goto out;
+        }
+        if (w[i].is_writer || (path != PATH_FWD_RW && path != PATH_SPLICE))
+            continue;
+        w[i].sink = open(cfg.sink, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (w[i].sink < 0) {
+            perror(cfg.sink);
+            goto out;
+        }
+        if (path == PATH_SPLICE) {
+            if (pipe(w[i].pipe) < 0) {
+                perror("pipe");
+                goto out;
+            }
+            if (size > 65536) // Room for a whole message, or splice() moves less per call
+                fcntl(w[i].pipe[1], F_SETPIPE_SZ, (int)size);
+        }
+    }
+
+    start = now_ns();
+    for (started = 0; started < nw + nr; started++)
+        if (pthread_create(&tid[started], NULL, worker_main, &w[started]))
+            break;
+    if (started == nw + nr)
+        usleep(cfg.duration * 1e6);
+    run.stop_writers = 1;
+    for (i = 0; i < nw && i < started; i++)
+        pthread_join(tid[i], NULL);
+    elapsed = now_ns() - start;
+
+    /*
+     * Readers may be asleep on an empty ring. Feed single bytes through a
+     * writer fd, which also works in SPSC mode where a second writer cannot
+     * open, until every reader has noticed the stop flag and returned.
+     * Without any writer fd, cancel the readers blocked in read().
+     */
+    run.stop_readers = 1;
+    kick = nw > 0 ? w[0].fd : -1;
+    if (kick >= 0)
+        fcntl(kick, F_SETFL, O_NONBLOCK);
+    for (i = nw; i < started; i++) {
+        while (path != PATH_MMAP && pthread_tryjoin_np(tid[i], NULL)) {
+            if (kick < 0 || (write(kick, "", 1) < 0 && errno != EAGAIN)) {
+                pthread_cancel(tid[i]);
+                pthread_join(tid[i], NULL);
+                break;
+            }
+            usleep(1000);
+        }
+        if (path == PATH_MMAP)
+            pthread_join(tid[i], NULL);
+    }
+    if (started < nw + nr) {
+        perror("pthread_create");
+        goto out;
+    }
+
+    failed = 0;
+    for (i = 0; i < nw + nr; i++) {
+        hist_merge(w[i].is_writer ? wh : rh, &w[i].hist);
+        if (w[i].is_writer) {
+            ops += w[i].ops;
+            bytes += w[i].bytes;
+        }
+        failed |= w[i].failed;
+    }
+    report(&run, nw, nr, elapsed / 1e9, ops, bytes, wh, rh, first);
+    failed = failed ? -1 : 0;
+
+out:
+    for (i = 0; w && i < nw + nr; i++) {
+        if (w[i].fd >= 0)
+            close(w[i].fd);
+        if (w[i].sink >= 0)
+            close(w[i].sink);
+        if (w[i].pipe[0] >= 0) {
+            close(w[i].pipe[0]);
+            close(w[i].pipe[1]);
+        }
+    }
+    if (run.map)
+        munmap(run.map, run.map_len);
+    free(w);
+    free(tid);
+    free(wh);
+    free(rh);
+    return failed;
+}
+
+/* Parse a comma separated list of numbers */
+static int parse_list(const char *arg, long *out, int max)
+{
+    char *copy = strdup(arg), *tok, *save;
+    int n = 0;
+
+    for (tok = strtok_r(copy, ",", &save); tok && n < max; tok = strtok_r(NULL, ",", &save))
+        out[n++] = strtol(tok, NULL, 0);
+    free(copy);
+    return n;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [--dev PATH] [--path rw,readv,io_uring,mmap,fwd_rw,splice]\n"
+            "          [--sizes N,...] [--writers N,...] [--readers N,...] [--batch N]\n"
+            "          [--duration SECS] [--mode stream|spsc] [--sink PATH] [--format csv|json]\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        { "dev", required_argument, NULL, 'd' },
+        { "path", required_argument, NULL, 'p' },
+        { "sizes", required_argument, NULL, 's' },
+        { "writers", required_argument, NULL, 'w' },
+        { "readers", required_argument, NULL, 'r' },
+        { "batch", required_argument, NULL, 'b' },
+        { "duration", required_argument, NULL, 't' },
+        { "mode", required_argument, NULL, 'm' },
+        { "format", required_argument, NULL, 'f' },
+        { "sink", required_argument, NULL, 'o' },
+        { NULL, 0, NULL, 0 },
+    };
+    long list[MAX_LIST];
+    int opt, i, p, s, nw, nr, first = 1;
+    char *tok, *save;
+
+    cfg.paths[0] = PATH_RW;
+    cfg.nr_paths = 1;
+    cfg.sizes[0] = 4096;
+    cfg.nr_sizes = 1;
+    cfg.writers[0] = cfg.readers[0] = 1;
+    cfg.nr_writers = cfg.nr_readers = 1;
+
+    while ((opt = getopt_long(argc, argv, "d:p:s:w:r:b:t:m:f:o:", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            cfg.dev = optarg;
+            break;
+        case 'p':
+            cfg.nr_paths = 0;
+            for (tok = strtok_r(optarg, ",", &save); tok && cfg.nr_paths < NR_PATHS;
+                 tok = strtok_r(NULL, ",", &save)) {
+                for (p = 0; p < NR_PATHS && strcmp(tok, path_names[p]); p++)
+                    ;
+                if (p == NR_PATHS) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                cfg.paths[cfg.nr_paths++] = p;
+            }
+            break;
+        case 's':
+            cfg.nr_sizes = parse_list(optarg, list, MAX_LIST);
+            for (i = 0; i < cfg.nr_sizes; i++)
+                cfg.sizes[i] = list[i];
+            break;
+        case 'w':
+            cfg.nr_writers = parse_list(optarg, list, MAX_LIST);
+            for (i = 0; i < cfg.nr_writers; i++)
+                cfg.writers[i] = list[i];
+            break;
+        case 'r':
+            cfg.nr_readers = parse_list(optarg, list, MAX_LIST);
+            for (i = 0; i < cfg.nr_readers; i++)
+                cfg.readers[i] = list[i];
+            break;
+        case 'b':
+            cfg.batch = atoi(optarg);
+            if (cfg.batch < 1 || cfg.batch > MAX_BATCH)
+                cfg.batch = 8;
+            break;
+        case 't':
+            cfg.duration = atof(optarg);
+            break;
+        case 'm':
+            cfg.mode = strcmp(optarg, "spsc") ? CHRDRV_MODE_STREAM : CHRDRV_MODE_SPSC;
+            break;
+        case 'f':
+            cfg.json = !strcmp(optarg, "json");
+            break;
+        case 'o':
+            cfg.sink = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (cfg.json)
+        printf("[\n");
+    else
+        printf("path,size,writers,readers,ops_per_sec,mb_per_sec,"
+               "write_p50_ns,write_p99_ns,write_p999_ns,read_p50_ns,read_p99_ns,read_p999_ns\n");
+
+    for (p = 0; p < cfg.nr_paths; p++)
+        for (s = 0; s < cfg.nr_sizes; s++)
+            for (nw = 0; nw < cfg.nr_writers; nw++)
+                for (nr = 0; nr < cfg.nr_readers; nr++) {
+                    int w = cfg.writers[nw], r = cfg.readers[nr];
+
+                    if (cfg.sizes[s] == 0 || w < 1 || r < 1)
+                        continue;
+                    if (cfg.paths[p] == PATH_MMAP && (w != 1 || r != 1))
+                        continue; // The mapping has one producer and one consumer
+                    if (run_one(cfg.paths[p], cfg.sizes[s], w, r, first) < 0)
+                        return EXIT_FAILURE;
+                    first = 0;
+                }
+
+    if (cfg.json)
+        printf("\n]\n");
+    return EXIT_SUCCESS;
+}
@@ -2,61 +2,1129 @@
 #include<linux/kernel.h>
 #include<linux/init.h>
 #include<linux/module.h>
+#include<linux/moduleparam.h>
 #include<linux/device.h>
 #include<linux/fs.h>
 #include <linux/slab.h>
 #include <linux/cdev.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/log2.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/sysfs.h>
 #include<linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/jiffies.h>
+#include <linux/shrinker.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <linux/vmalloc.h>
+#include <linux/iosys-map.h>
+#include <linux/async.h>
+
+#include "chrdrv.h"
+
+#define CREATE_TRACE_POINTS
+#include "chrdrv_trace.h"
 
 /* Macros for configuration */
 #define DYNAMIC 1 // Flag for dynamic allocation
 #define DEVICE_NAME "new_device" // Name of the device
 #define MAJOR_NUM 255 // Major number for static allocation
 #define MINOR_NUM 0 // Minor number for static allocation
-#define mem_size 1024 // Size of the memory buffer
+#define MIN_BUF_SIZE PAGE_SIZE // Smallest ring buffer (one page)
+#define MAX_BUF_SIZE (16UL << 20) // Largest ring buffer (16 MB)
+#define MAX_DEVS 8192 // Largest number of device instances
+
+struct chrdrv_dev;
+static struct chrdrv_dev **devs; // Device instances
+static unsigned int nr_devs = 1;
+static bool devs_live; // Set once every instance exists, under the module's parameter lock
+static int chrdrv_pages_claim_resize(struct chrdrv_dev *dev);
+static void chrdrv_pages_unclaim(struct chrdrv_dev *dev);
+static int chrdrv_dev_resize(struct chrdrv_dev *dev, size_t size);
+
+/* Clamp a requested ring size to the supported range, rounded up to a power of two */
+static size_t chrdrv_buf_size(unsigned int size)
+{
+	return roundup_pow_of_two(clamp_t(size_t, size, MIN_BUF_SIZE, MAX_BUF_SIZE));
+}
+
+/*
+ * Set callback of buf_size. At load time it only records the value; once
+ * the devices exist it resizes every instance live, keeping unread data.
+ * The write applies to all instances or to none: every page array is
+ * claimed first, so a mapped instance fails it before anything changed,
+ * and if an instance cannot be resized (more unread data than the new
+ * size, or no memory) the ones done before it are resized back.
+ */
+static int buf_size_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned int old = *(unsigned int *)kp->arg;
+	unsigned int size;
+	unsigned int i, n;
+	int ret;
+
+	ret = kstrtouint(val, 0, &size);
+	if (ret)
+		return ret;
+	if (!devs_live) {
+		*(unsigned int *)kp->arg = size;
+		return 0;
+	}
+
+	size = chrdrv_buf_size(size);
+	for (i = 0; i < nr_devs; i++) {
+		ret = chrdrv_pages_claim_resize(devs[i]);
+		if (ret) {
+			pr_err("cannot resize %s%u while it is mapped \n", DEVICE_NAME, i);
+			goto unclaim;
+		}
+	}
+
+	for (n = 0; n < nr_devs; n++) {
+		ret = chrdrv_dev_resize(devs[n], size);
+		if (ret)
+			break;
+	}
+	if (ret) {
+		pr_err("cannot resize %s%u to %u bytes: %d \n", DEVICE_NAME, n, size, ret);
+		while (n--) {
+			if (chrdrv_dev_resize(devs[n], old))
+				pr_err("cannot restore %s%u to %u bytes \n", DEVICE_NAME, n, old);
+		}
+	} else {
+		*(unsigned int *)kp->arg = size;
+	}
+unclaim:
+	while (i--)
+		chrdrv_pages_unclaim(devs[i]);
+	return ret;
+}
+
+static const struct kernel_param_ops buf_size_ops = {
+	.set = buf_size_set,
+	.get = param_get_uint,
+};
+
+/* Ring buffer size in bytes, rounded up to a power of two pages; writable at run time */
+static unsigned int buf_size = 65536;
+module_param_cb(buf_size, &buf_size_ops, &buf_size, S_IRUSR | S_IWUSR | S_IRGRP);
+MODULE_PARM_DESC(buf_size, "Ring buffer size in bytes (default 65536, max 16M), resizes live when written");
+
+/* Number of device instances, /dev/new_device0 .. /dev/new_device<nr_devs - 1> */
+module_param(nr_devs, uint, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(nr_devs, "Number of device instances (default 1, max 8192)");
+
+/* Create and destroy the instances on async workers instead of one by one */
+static bool parallel_init = true;
+module_param(parallel_init, bool, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(parallel_init, "Create and destroy instances in parallel (default 1)");
+
+/* Initial message mode queue configuration of every instance */
+static unsigned int msg_depth;
+module_param(msg_depth, uint, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(msg_depth, "Message mode queue depth in records (default 0 = ring size only)");
+
+static unsigned int msg_policy = CHRDRV_MSG_BLOCK;
+module_param(msg_policy, uint, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(msg_policy, "Message mode full queue policy: 0 = block, 1 = drop oldest");
+
+/* Initial fan-out lag limit of every instance */
+static unsigned int lag_limit;
+module_param(lag_limit, uint, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(lag_limit, "Fan-out mode reader lag limit in bytes (default 0 = writers wait for the slowest reader)");
+
+/* Ring pages without unread data, unwritten for this long, may be reclaimed */
+static unsigned int idle_ms = 10000;
+module_param(idle_ms, uint, S_IRUSR | S_IWUSR | S_IRGRP);
+MODULE_PARM_DESC(idle_ms, "Release ring pages idle this long under memory pressure (ms, default 10000)");
+
+/*
+ * Page-backed ring buffer. The data lives in nr_pages order-0 pages, so large
+ * buffers never need a high-order allocation. The head and tail indices live
+ * in a separate control page (struct chrdrv_ctrl) so that they can be mapped
+ * into user space together with the data pages.
+ *
+ * Data pages are allocated on first write or first fault of a mapping, and
+ * given back by the shrinker once they hold no unread data and have been
+ * idle for idle_ms. page_private() of a data page holds the jiffies of its
+ * last write.
+ */
+struct chrdrv_ring {
+	struct page **pages; // Backing pages, NULL until first used
+	unsigned int nr_pages; // Number of backing pages
+	atomic_t nr_resident; // Backing pages currently allocated
+	int nid; // Memory node of the pages
+	size_t size; // Buffer size in bytes (power of two)
+	struct page *ctrl_page; // Page holding the control header
+	struct chrdrv_ctrl *ctrl; // Kernel address of the control header
+};
+
+/* Operations with a latency histogram */
+enum chrdrv_lat_op {
+	CHRDRV_LAT_READ,
+	CHRDRV_LAT_WRITE,
+	CHRDRV_LAT_OPEN,
+	CHRDRV_LAT_OPS,
+};
+
+#define CHRDRV_LAT_BUCKETS 32 // Bucket i counts latencies in [2^i, 2^(i+1)) ns
+
+/*
+ * Per device statistics. Every CPU updates its own copy, so the hot path
+ * never writes a cache line shared with another CPU; sysfs sums them up.
+ */
+struct chrdrv_stats {
+	u64 bytes_read; // Bytes copied out of the ring
+	u64 bytes_written; // Bytes copied into the ring
+	u64 reads; // Successful read calls
+	u64 writes; // Successful write calls
+	u64 short_reads; // Reads that returned less than requested
+	u64 faults; // Calls that failed with -EFAULT
+	u64 waits; // Times a reader or writer went to sleep
+	u64 msgs_dropped; // Records discarded by the drop oldest policy
+	u64 lag_skips; // Fan-out readers moved forward past the lag limit
+	u64 lat[CHRDRV_LAT_OPS][CHRDRV_LAT_BUCKETS]; // log2 latency histograms
+};
+
+#define chrdrv_stat_inc(dev, field) this_cpu_inc((dev)->stats->field)
+#define chrdrv_stat_add(dev, field, val) this_cpu_add((dev)->stats->field, val)
+
+/*
+ * Per device state. Every instance is a separate allocation on the memory
+ * node of the CPU it is meant for, so instances used from different cores
+ * share no cache lines. Opened files reach it through their struct
+ * chrdrv_file.
+ */
+struct chrdrv_dev {
+	struct mutex lock; // Serialises readers and writers
+	struct percpu_rw_semaphore io_sem; // Held for read by I/O, for write by a mode switch or a resize
+	spinlock_t map_lock; // Guards nr_maps and pages_busy
+	unsigned int nr_maps; // Live mappings and dma-buf exports of the ring, which pin its pages
+	bool pages_busy; // The page array is being replaced or trimmed
+	bool pages_resizing; // pages_busy is held by a resize, which pinning does not wait for
+	wait_queue_head_t pages_wq; // Waiting for pages_busy to clear
+	struct chrdrv_ring ring; // Data buffer
+	wait_queue_head_t readq; // Readers waiting for data
+	wait_queue_head_t writeq; // Writers waiting for space
+	struct chrdrv_stats __percpu *stats; // Counters and latency histograms
+	enum chrdrv_mode mode; // Access mode, see chrdrv.h
+	u32 msg_depth; // Message mode queue depth, 0 = unlimited
+	u32 msg_policy; // Message mode full queue policy
+	u32 lag_limit; // Fan-out mode reader lag limit in bytes, 0 = none
+	struct list_head readers; // struct chrdrv_file of the files open for reading
+	unsigned int nr_readers; // Files open for reading
+	unsigned int nr_writers; // Files open for writing
+	struct cdev cdev; // Character device for this minor
+	struct device *device; // Device node in new_class
+	unsigned int index; // Instance number (minor)
+};
+
+/*
+ * Per open file state, in private_data. In fan-out mode every reader reads
+ * at its own cursor, and the ring tail is the cursor of the slowest one.
+ */
+struct chrdrv_file {
+	struct chrdrv_dev *dev; // Device instance
+	struct list_head node; // Entry in dev->readers, if open for reading
+	u32 cursor; // Next byte to read in fan-out mode, under dev->lock
+	bool lagged; // Moved forward by a writer, the next read fails with -EOVERFLOW
+};
+
+/* Device instance of an open file */
+static struct chrdrv_dev *chrdrv_file_dev(struct file *filep)
+{
+	return ((struct chrdrv_file *)filep->private_data)->dev;
+}
 
 /* Declare global variables and structures */
-static struct cdev new_cdev; // Character device structure
-static dev_t dev_num; // Device number
+static dev_t dev_num; // First device number of the minor range
 static struct class *dev_class; // Device class
-static struct device *dev_device; // Device structure
-uint8_t *local_buffer; // Pointer for memory allocation
-
-static int major_num; // Major number for dynamic allocation
 
 /* Function prototypes for file operations */
 static int dev_open(struct inode *, struct file *);
 static int dev_release(struct inode *, struct file *);
-static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
-static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t dev_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t dev_write_iter(struct kiocb *, struct iov_iter *);
+static ssize_t dev_splice_read(struct file *, loff_t *, struct pipe_inode_info *, size_t,
+			       unsigned int);
+static int dev_mmap(struct file *, struct vm_area_struct *);
+static __poll_t dev_poll(struct file *, poll_table *);
+static long dev_ioctl(struct file *, unsigned int, unsigned long);
+
+/* Latency accounting, defined with the I/O paths */
+static void chrdrv_lat_record(struct chrdrv_dev *, enum chrdrv_lat_op, u64);
 
 /* File operations structure */
 static struct file_operations fops=
 {
 	.owner=THIS_MODULE, // Module owner
 	.open=dev_open, // Open function
-	.read=dev_read, // Read function
-	.write=dev_write, // Write function
+	.read_iter=dev_read_iter, // Read function (read, readv, io_uring)
+	.write_iter=dev_write_iter, // Write function (write, writev, io_uring)
+	.splice_read=dev_splice_read, // splice()/sendfile() out of the ring
+	.splice_write=iter_file_splice_write, // splice() into the ring, through write_iter
+	.mmap=dev_mmap, // Map the ring into user space
+	.poll=dev_poll, // Readiness for poll/select/epoll
+	.unlocked_ioctl=dev_ioctl, // Mode control
+	.compat_ioctl=compat_ptr_ioctl, // 32-bit callers on 64-bit kernels
 	.release=dev_release, // Release function
 };
 
+/* Free a data page, clearing the timestamp kept in its private field */
+static void chrdrv_page_free(struct page *page)
+{
+	set_page_private(page, 0);
+	__free_page(page);
+}
+
+/* Free an array of nr data pages and the pages allocated so far */
+static void chrdrv_pages_free(struct page **pages, unsigned int nr)
+{
+	unsigned int i;
+
+	if (!pages)
+		return;
+	for (i = 0; i < nr; i++)
+		if (pages[i])
+			chrdrv_page_free(pages[i]);
+	kvfree(pages);
+}
+
+/*
+ * Allocate an empty array for nr data pages on memory node nid. Large rings
+ * need a large array, which vmalloc provides when contiguous memory is short.
+ */
+static struct page **chrdrv_pages_alloc(unsigned int nr, int nid)
+{
+	return kvzalloc_node(array_size(nr, sizeof(struct page *)), GFP_KERNEL, nid);
+}
+
+/*
+ * Return the data page in slot, allocating it if it does not exist yet.
+ * Writers and page faults of a mapping may race to fill a slot; the loser
+ * frees its page and uses the winner's.
+ */
+static struct page *chrdrv_ring_page(struct chrdrv_ring *ring, struct page **slot, gfp_t gfp)
+{
+	struct page *page = READ_ONCE(*slot);
+
+	if (page)
+		return page;
+	page = alloc_pages_node(ring->nid, gfp | __GFP_ZERO, 0); // May be mapped, never leak old data
+	if (!page)
+		return NULL;
+	set_page_private(page, jiffies);
+	if (cmpxchg(slot, NULL, page)) {
+		__free_page(page);
+		return READ_ONCE(*slot);
+	}
+	atomic_inc(&ring->nr_resident);
+	return page;
+}
+
+/*
+ * Make sure the pages behind len bytes at ring position pos exist before a
+ * writer copies into them, and stamp them as just written. Fails with
+ * -ENOMEM, or -EAGAIN for a writer that must not sleep.
+ */
+static int chrdrv_ring_prepare(struct chrdrv_ring *ring, u32 pos, size_t len, bool nowait)
+{
+	gfp_t gfp = nowait ? GFP_NOWAIT : GFP_KERNEL;
+	size_t done = 0;
+
+	while (done < len) {
+		size_t off = (pos + done) & (ring->size - 1);
+		struct page *page;
+
+		page = chrdrv_ring_page(ring, &ring->pages[off >> PAGE_SHIFT], gfp);
+		if (!page)
+			return nowait ? -EAGAIN : -ENOMEM;
+		set_page_private(page, jiffies);
+		done += min_t(size_t, len - done, PAGE_SIZE - offset_in_page(off));
+	}
+	return 0;
+}
+
+/* Free the backing pages of a ring buffer */
+static void chrdrv_ring_free(struct chrdrv_ring *ring)
+{
+	if (ring->ctrl_page) {
+		__free_page(ring->ctrl_page);
+		ring->ctrl_page = NULL;
+		ring->ctrl = NULL;
+	}
+	chrdrv_pages_free(ring->pages, ring->nr_pages);
+	ring->pages = NULL;
+}
+
+/* Allocate a ring buffer of size bytes (a power of two multiple of PAGE_SIZE) on memory node nid */
+static int chrdrv_ring_alloc(struct chrdrv_ring *ring, size_t size, int nid)
+{
+	ring->size = size;
+	ring->nr_pages = size >> PAGE_SHIFT;
+	ring->nid = nid;
+	ring->ctrl_page = alloc_pages_node(nid, GFP_KERNEL | __GFP_ZERO, 0);
+	if (!ring->ctrl_page)
+		return -ENOMEM;
+	ring->ctrl = page_address(ring->ctrl_page);
+	ring->ctrl->size = size;
+	ring->ctrl->data_offset = PAGE_SIZE;
+
+	ring->pages = chrdrv_pages_alloc(ring->nr_pages, nid);
+	if (!ring->pages) {
+		chrdrv_ring_free(ring);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Number of unread bytes. The indices may also be moved by a user space
+ * producer or consumer through the mapping, so never trust them beyond the
+ * ring size.
+ */
+static size_t chrdrv_ring_used(struct chrdrv_ring *ring, u32 head, u32 tail)
+{
+	return min_t(size_t, head - tail, ring->size);
+}
+
+/* Number of unread bytes, sampled without the device lock */
+static size_t chrdrv_ring_count(struct chrdrv_ring *ring)
+{
+	return chrdrv_ring_used(ring, READ_ONCE(ring->ctrl->head), READ_ONCE(ring->ctrl->tail));
+}
+
+/*
+ * Lock the device for a read or write. The read side of io_sem keeps a
+ * resize out; it is a per-CPU counter, so it writes no shared cache line. In
+ * SPSC mode there is only one reader and one writer, which coordinate
+ * through the ring indices alone, so the mutex is not taken. Returns whether
+ * the mutex is held. A nowait caller (io_uring) gets -EAGAIN rather than
+ * sleeping on a contended lock.
+ */
+static int chrdrv_lock(struct chrdrv_dev *dev, bool *locked, bool nowait)
+{
+	if (nowait) {
+		if (!percpu_down_read_trylock(&dev->io_sem))
+			return -EAGAIN;
+	} else {
+		percpu_down_read(&dev->io_sem);
+	}
+	*locked = READ_ONCE(dev->mode) != CHRDRV_MODE_SPSC;
+	if (!*locked)
+		return 0;
+	if (nowait ? !mutex_trylock(&dev->lock) : mutex_lock_interruptible(&dev->lock)) {
+		percpu_up_read(&dev->io_sem);
+		return nowait ? -EAGAIN : -ERESTARTSYS;
+	}
+	return 0;
+}
+
+/* Whether an I/O request must not sleep */
+static bool chrdrv_nowait(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+static void chrdrv_unlock(struct chrdrv_dev *dev, bool locked)
+{
+	if (locked)
+		mutex_unlock(&dev->lock);
+	percpu_up_read(&dev->io_sem);
+}
+
+/*
+ * Wake the sleepers on a wait queue. The poll key lets epoll skip waiters
+ * that are not interested in this event, and the sleeper check keeps the
+ * wait queue lock off the path when nobody is waiting.
+ */
+static void chrdrv_wake(wait_queue_head_t *wq, __poll_t events)
+{
+	if (wq_has_sleeper(wq))
+		wake_up_interruptible_poll(wq, events);
+}
+
+/*
+ * Copy len bytes at ring position pos to a kernel buffer. A missing page
+ * reads as zeroes; it can only be met if a user space producer moved head
+ * without writing through its mapping.
+ */
+static void chrdrv_ring_read(struct chrdrv_ring *ring, u32 pos, void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		size_t off = (pos + done) & (ring->size - 1);
+		size_t poff = offset_in_page(off);
+		size_t chunk = min_t(size_t, len - done, PAGE_SIZE - poff);
+		struct page *page = ring->pages[off >> PAGE_SHIFT];
+
+		if (page)
+			memcpy(buf + done, page_address(page) + poff, chunk);
+		else
+			memset(buf + done, 0, chunk);
+		done += chunk;
+	}
+}
+
+/* Copy len bytes from a kernel buffer to ring position pos, prepared by chrdrv_ring_prepare() */
+static void chrdrv_ring_write(struct chrdrv_ring *ring, u32 pos, const void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		size_t off = (pos + done) & (ring->size - 1);
+		size_t poff = offset_in_page(off);
+		size_t chunk = min_t(size_t, len - done, PAGE_SIZE - poff);
+
+		memcpy(page_address(ring->pages[off >> PAGE_SHIFT]) + poff, buf + done, chunk);
+		done += chunk;
+	}
+}
+
+/*
+ * Copy up to len bytes starting at ring position pos into an iov_iter, which
+ * may span many user buffers (readv, io_uring). Returns bytes copied.
+ */
+static size_t chrdrv_ring_copy_to_iter(struct chrdrv_ring *ring, u32 pos,
+				       struct iov_iter *to, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		size_t off = (pos + done) & (ring->size - 1);
+		size_t poff = offset_in_page(off);
+		size_t chunk = min_t(size_t, len - done, PAGE_SIZE - poff);
+		struct page *page = ring->pages[off >> PAGE_SHIFT];
+		size_t copied;
+
+		if (page)
+			copied = copy_to_iter(page_address(page) + poff, chunk, to);
+		else
+			copied = iov_iter_zero(chunk, to); // See chrdrv_ring_read()
+		done += copied;
+		if (copied != chunk)
+			break;
+	}
+	return done;
+}
+
+/*
+ * Copy up to len bytes from an iov_iter to ring position pos, prepared by
+ * chrdrv_ring_prepare(). Returns bytes copied.
+ */
+static size_t chrdrv_ring_copy_from_iter(struct chrdrv_ring *ring, u32 pos,
+					 struct iov_iter *from, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		size_t off = (pos + done) & (ring->size - 1);
+		size_t poff = offset_in_page(off);
+		size_t chunk = min_t(size_t, len - done, PAGE_SIZE - poff);
+		size_t copied;
+
+		copied = copy_from_iter(page_address(ring->pages[off >> PAGE_SHIFT]) + poff,
+					chunk, from);
+		done += copied;
+		if (copied != chunk)
+			break;
+	}
+	return done;
+}
+
+/*
+ * Copy the used bytes at ring position pos into the page array of a ring of
+ * size bytes, to the same position. Keeping the free running indices lets
+ * readers and writers carry on as if nothing happened. Only the pages that
+ * receive data are allocated. Returns the number of pages allocated, or
+ * -ENOMEM.
+ */
+static int chrdrv_ring_migrate(struct chrdrv_ring *ring, struct page **pages, size_t size,
+			       u32 pos, size_t used)
+{
+	size_t done = 0;
+	int nr = 0;
+
+	while (done < used) {
+		size_t from = (pos + done) & (ring->size - 1);
+		size_t to = (pos + done) & (size - 1);
+		size_t chunk = min3(used - done, PAGE_SIZE - offset_in_page(from),
+				    PAGE_SIZE - offset_in_page(to));
+		struct page **slot = &pages[to >> PAGE_SHIFT];
+		struct page *src = ring->pages[from >> PAGE_SHIFT];
+
+		if (!*slot) {
+			*slot = alloc_pages_node(ring->nid, GFP_KERNEL | __GFP_ZERO, 0);
+			if (!*slot)
+				return -ENOMEM;
+			set_page_private(*slot, jiffies);
+			nr++;
+		}
+		if (src)
+			memcpy(page_address(*slot) + offset_in_page(to),
+			       page_address(src) + offset_in_page(from), chunk);
+		done += chunk;
+	}
+	return nr;
+}
+
+/*
+ * Claim the page array of an instance for replacing or trimming it, which
+ * keeps new mappings out. Fails with -EBUSY while the ring is mapped and
+ * -EAGAIN while someone else holds the claim. This cannot be dev->lock:
+ * mmap() runs under mmap_lock, which the I/O paths take in turn (page
+ * faults on the user buffers) while holding dev->lock.
+ */
+static int chrdrv_pages_claim(struct chrdrv_dev *dev)
+{
+	int ret = 0;
+
+	spin_lock(&dev->map_lock);
+	if (dev->nr_maps)
+		ret = -EBUSY;
+	else if (dev->pages_busy)
+		ret = -EAGAIN;
+	else
+		dev->pages_busy = true;
+	spin_unlock(&dev->map_lock);
+	return ret;
+}
+
+/*
+ * Claim the page array for a resize, waiting while a trim pass or a splice
+ * holds it. Until the claim is dropped, chrdrv_pages_pin() fails instead
+ * of waiting: the resize waits for io_sem, whose readers may fault on user
+ * memory, so an mmap() waiting under mmap_lock could deadlock with it.
+ */
+static int chrdrv_pages_claim_resize(struct chrdrv_dev *dev)
+{
+	int ret;
+
+	wait_event(dev->pages_wq, (ret = chrdrv_pages_claim(dev)) != -EAGAIN);
+	if (!ret) {
+		spin_lock(&dev->map_lock);
+		dev->pages_resizing = true;
+		spin_unlock(&dev->map_lock);
+	}
+	return ret;
+}
+
+static void chrdrv_pages_unclaim(struct chrdrv_dev *dev)
+{
+	spin_lock(&dev->map_lock);
+	dev->pages_busy = false;
+	dev->pages_resizing = false;
+	spin_unlock(&dev->map_lock);
+	if (wq_has_sleeper(&dev->pages_wq))
+		wake_up_all(&dev->pages_wq);
+}
+
+/* Pin the page array: 0 when pinned, -EAGAIN while claimed, -EBUSY during a resize */
+static int chrdrv_pages_trypin(struct chrdrv_dev *dev)
+{
+	int ret = 0;
+
+	spin_lock(&dev->map_lock);
+	if (dev->pages_resizing)
+		ret = -EBUSY;
+	else if (dev->pages_busy)
+		ret = -EAGAIN;
+	else
+		dev->nr_maps++;
+	spin_unlock(&dev->map_lock);
+	return ret;
+}
+
+/*
+ * Pin the page array of an instance for a mapping or a dma-buf export:
+ * while pinned, no page is replaced, trimmed or given to a pipe. The claim
+ * of a trim pass or of one page of a splice is brief, so this waits for it
+ * to drop rather than failing; during a resize it fails with -EBUSY.
+ */
+static int chrdrv_pages_pin(struct chrdrv_dev *dev)
+{
+	int ret;
+
+	if (wait_event_interruptible(dev->pages_wq, (ret = chrdrv_pages_trypin(dev)) != -EAGAIN))
+		return -ERESTARTSYS;
+	return ret;
+}
+
+static void chrdrv_pages_unpin(struct chrdrv_dev *dev)
+{
+	spin_lock(&dev->map_lock);
+	dev->nr_maps--;
+	spin_unlock(&dev->map_lock);
+}
+
+/*
+ * Resize the ring of an instance to size bytes, keeping its unread data.
+ * The new page array is allocated first; I/O is then quiesced with the
+ * write side of io_sem for the copy and the switch. The control page is
+ * kept, so lockless readers of the indices (poll, wait conditions) never
+ * see it go away. The caller holds the page claim, which keeps mappings
+ * out. Fails with -ENOSPC if the unread data would not fit.
+ */
+static int chrdrv_dev_resize(struct chrdrv_dev *dev, size_t size)
+{
+	struct chrdrv_ring *ring = &dev->ring;
+	unsigned int nr = size >> PAGE_SHIFT;
+	struct page **pages, **old;
+	u32 head, tail;
+	size_t used;
+	int ret = 0;
+
+	if (size == ring->size)
+		return 0;
+	pages = chrdrv_pages_alloc(nr, ring->nid);
+	if (!pages)
+		return -ENOMEM;
+
+	percpu_down_write(&dev->io_sem);
+	mutex_lock(&dev->lock);
+	tail = READ_ONCE(ring->ctrl->tail);
+	head = READ_ONCE(ring->ctrl->head);
+	used = chrdrv_ring_used(ring, head, tail);
+	if (used > size) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	ret = chrdrv_ring_migrate(ring, pages, size, tail, used);
+	if (ret < 0)
+		goto out;
+	atomic_set(&ring->nr_resident, ret);
+	ret = 0;
+	WRITE_ONCE(ring->ctrl->head, tail + (u32)used);
+
+	old = ring->pages;
+	ring->pages = pages;
+	pages = old;
+	swap(ring->nr_pages, nr);
+	ring->size = size;
+	ring->ctrl->size = size;
+out:
+	mutex_unlock(&dev->lock);
+	percpu_up_write(&dev->io_sem);
+	chrdrv_pages_free(pages, nr); // The old pages, or the unused new ones
+	if (!ret)
+		chrdrv_wake(&dev->writeq, EPOLLOUT | EPOLLWRNORM);
+	return ret;
+}
+
+/* Whether data page i of a ring holds any of the used bytes starting at tail */
+static bool chrdrv_page_in_use(struct chrdrv_ring *ring, unsigned int i, u32 tail, size_t used)
+{
+	size_t rel = ((i << PAGE_SHIFT) - tail) & (ring->size - 1); // Page start, relative to tail
+
+	return used && (rel < used || rel > ring->size - PAGE_SIZE);
+}
+
+/*
+ * Free up to max idle data pages of an instance: pages without unread data,
+ * last written more than idle_ms ago. Only free space is touched, which
+ * readers never look at. Writers are kept out by dev->lock, or in SPSC
+ * mode by there being none; mapped rings are skipped. Nothing here sleeps
+ * on a lock, since the caller may be reclaiming for one of our writers.
+ */
+static unsigned long chrdrv_dev_trim(struct chrdrv_dev *dev, unsigned long max)
+{
+	struct chrdrv_ring *ring = &dev->ring;
+	unsigned long idle = msecs_to_jiffies(READ_ONCE(idle_ms));
+	unsigned long freed = 0;
+	unsigned int i;
+	size_t used;
+	u32 tail;
+
+	if (!atomic_read(&ring->nr_resident) || !mutex_trylock(&dev->lock))
+		return 0;
+	if ((dev->mode == CHRDRV_MODE_SPSC && dev->nr_writers) || chrdrv_pages_claim(dev))
+		goto out;
+
+	tail = smp_load_acquire(&ring->ctrl->tail); // A stale tail only keeps more pages
+	used = chrdrv_ring_used(ring, READ_ONCE(ring->ctrl->head), tail);
+	for (i = 0; i < ring->nr_pages && freed < max; i++) {
+		struct page *page = ring->pages[i];
+
+		if (!page || chrdrv_page_in_use(ring, i, tail, used) ||
+		    time_before(jiffies, page_private(page) + idle))
+			continue;
+		ring->pages[i] = NULL;
+		chrdrv_page_free(page);
+		freed++;
+	}
+	atomic_sub(freed, &ring->nr_resident);
+	chrdrv_pages_unclaim(dev);
+out:
+	mutex_unlock(&dev->lock);
+	return freed;
+}
+
+/* Shrinker callbacks: resident data pages of all instances are the objects */
+static unsigned long chrdrv_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+	unsigned long count = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr_devs; i++)
+		count += atomic_read(&devs[i]->ring.nr_resident);
+	return count ?: SHRINK_EMPTY;
+}
+
+static unsigned long chrdrv_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+	static unsigned int next; // Instance to start with, so all of them take turns
+	unsigned long freed = 0;
+	unsigned int i, n;
+
+	for (n = 0; n < nr_devs && freed < sc->nr_to_scan; n++) {
+		i = READ_ONCE(next) % nr_devs;
+		WRITE_ONCE(next, i + 1);
+		freed += chrdrv_dev_trim(devs[i], sc->nr_to_scan - freed);
+	}
+	return freed ?: SHRINK_STOP;
+}
+
+static struct shrinker chrdrv_shrinker = {
+	.count_objects = chrdrv_shrink_count,
+	.scan_objects = chrdrv_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
+/* Sum one counter of a device over all CPUs; offset is its offset in struct chrdrv_stats */
+static u64 chrdrv_stat_sum(struct chrdrv_dev *dev, size_t offset)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *(u64 *)((char *)per_cpu_ptr(dev->stats, cpu) + offset);
+	return sum;
+}
+
+/* sysfs attribute showing one counter, /sys/class/new_class/new_deviceN/stats/<field> */
+#define CHRDRV_STAT_ATTR(field)							\
+static ssize_t field##_show(struct device *d, struct device_attribute *attr,	\
+			    char *buf)						\
+{										\
+	return sysfs_emit(buf, "%llu\n", chrdrv_stat_sum(dev_get_drvdata(d),	\
+				offsetof(struct chrdrv_stats, field)));		\
+}										\
+static DEVICE_ATTR_RO(field)
+
+CHRDRV_STAT_ATTR(bytes_read);
+CHRDRV_STAT_ATTR(bytes_written);
+CHRDRV_STAT_ATTR(reads);
+CHRDRV_STAT_ATTR(writes);
+CHRDRV_STAT_ATTR(short_reads);
+CHRDRV_STAT_ATTR(faults);
+CHRDRV_STAT_ATTR(waits);
+CHRDRV_STAT_ATTR(msgs_dropped);
+CHRDRV_STAT_ATTR(lag_skips);
+
+/* Show a latency histogram as CHRDRV_LAT_BUCKETS counts, bucket i = [2^i, 2^(i+1)) ns */
+static ssize_t chrdrv_lat_show(struct device *d, char *buf, enum chrdrv_lat_op op)
+{
+	struct chrdrv_dev *dev = dev_get_drvdata(d);
+	int len = 0;
+	int i;
+
+	for (i = 0; i < CHRDRV_LAT_BUCKETS; i++)
+		len += sysfs_emit_at(buf, len, "%llu%c",
+				     chrdrv_stat_sum(dev, offsetof(struct chrdrv_stats, lat) +
+						     (op * CHRDRV_LAT_BUCKETS + i) * sizeof(u64)),
+				     i == CHRDRV_LAT_BUCKETS - 1 ? '\n' : ' ');
+	return len;
+}
+
+static ssize_t read_latency_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return chrdrv_lat_show(d, buf, CHRDRV_LAT_READ);
+}
+static DEVICE_ATTR_RO(read_latency);
+
+static ssize_t write_latency_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return chrdrv_lat_show(d, buf, CHRDRV_LAT_WRITE);
+}
+static DEVICE_ATTR_RO(write_latency);
+
+static ssize_t open_latency_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	return chrdrv_lat_show(d, buf, CHRDRV_LAT_OPEN);
+}
+static DEVICE_ATTR_RO(open_latency);
+
+/* Writing anything to stats/reset clears all counters and histograms */
+static ssize_t reset_store(struct device *d, struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct chrdrv_dev *dev = dev_get_drvdata(d);
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(dev->stats, cpu), 0, sizeof(struct chrdrv_stats));
+	return count;
+}
+static DEVICE_ATTR_WO(reset);
+
+static struct attribute *chrdrv_stats_attrs[] = {
+	&dev_attr_bytes_read.attr,
+	&dev_attr_bytes_written.attr,
+	&dev_attr_reads.attr,
+	&dev_attr_writes.attr,
+	&dev_attr_short_reads.attr,
+	&dev_attr_faults.attr,
+	&dev_attr_waits.attr,
+	&dev_attr_msgs_dropped.attr,
+	&dev_attr_lag_skips.attr,
+	&dev_attr_read_latency.attr,
+	&dev_attr_write_latency.attr,
+	&dev_attr_open_latency.attr,
+	&dev_attr_reset.attr,
+	NULL,
+};
+
+static const struct attribute_group chrdrv_stats_group = {
+	.name = "stats",
+	.attrs = chrdrv_stats_attrs,
+};
+
+/* Memory use of the ring, /sys/class/new_class/new_deviceN/ring/{resident,size} in bytes */
+static ssize_t resident_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct chrdrv_dev *dev = dev_get_drvdata(d);
+
+	return sysfs_emit(buf, "%lu\n",
+			  (unsigned long)atomic_read(&dev->ring.nr_resident) << PAGE_SHIFT);
+}
+static DEVICE_ATTR_RO(resident);
+
+static ssize_t size_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct chrdrv_dev *dev = dev_get_drvdata(d);
+
+	return sysfs_emit(buf, "%zu\n", READ_ONCE(dev->ring.size));
+}
+static DEVICE_ATTR_RO(size);
+
+static struct attribute *chrdrv_ring_attrs[] = {
+	&dev_attr_resident.attr,
+	&dev_attr_size.attr,
+	NULL,
+};
+
+static const struct attribute_group chrdrv_ring_group = {
+	.name = "ring",
+	.attrs = chrdrv_ring_attrs,
+};
+
+static const struct attribute_group *chrdrv_groups[] = {
+	&chrdrv_stats_group,
+	&chrdrv_ring_group,
+	NULL,
+};
+
+/* Node an instance lives on: instances are spread over the online CPUs' nodes */
+static int chrdrv_dev_node(unsigned int index)
+{
+	return cpu_to_node(cpumask_nth(index % num_online_cpus(), cpu_online_mask));
+}
+
+/*
+ * Create device instance index. The state and ring are allocated on the
+ * memory node of CPU (index % online CPUs), so pinning the producer and
+ * consumer of instance i to that CPU keeps all their traffic node local.
+ */
+static struct chrdrv_dev *chrdrv_dev_create(unsigned int index, size_t size)
+{
+	int nid = chrdrv_dev_node(index);
+	struct chrdrv_dev *dev;
+	dev_t devt = MKDEV(MAJOR(dev_num), MINOR(dev_num) + index);
+	int ret;
+
+	dev = kzalloc_node(sizeof(*dev), GFP_KERNEL, nid);
+	if (!dev)
+		return ERR_PTR(-ENOMEM);
+	dev->index = index;
+	dev->msg_depth = msg_depth;
+	dev->msg_policy = msg_policy == CHRDRV_MSG_DROP_OLDEST ? CHRDRV_MSG_DROP_OLDEST : CHRDRV_MSG_BLOCK;
+	dev->lag_limit = lag_limit;
+	INIT_LIST_HEAD(&dev->readers);
+	mutex_init(&dev->lock);
+	spin_lock_init(&dev->map_lock);
+	init_waitqueue_head(&dev->pages_wq);
+	init_waitqueue_head(&dev->readq);
+	init_waitqueue_head(&dev->writeq);
+
+	ret = percpu_init_rwsem(&dev->io_sem);
+	if (ret)
+		goto sem_fail;
+
+	dev->stats = alloc_percpu(struct chrdrv_stats);
+	if (!dev->stats) {
+		ret = -ENOMEM;
+		goto stats_fail;
+	}
+
+	ret = chrdrv_ring_alloc(&dev->ring, size, nid);
+	if (ret < 0) {
+		pr_err("cannot allocate %zu byte ring buffer \n", size);
+		goto ring_fail;
+	}
+
+	// Initialize the cdev structure and add it to the system
+	cdev_init(&dev->cdev, &fops);
+	dev->cdev.owner = THIS_MODULE;
+	ret = cdev_add(&dev->cdev, devt, 1);
+	if (ret < 0) {
+		pr_err("unable to create cdev add \n");
+		goto cdev_fail;
+	}
+
+	// Create a device and associate it with the class
+	dev->device = device_create_with_groups(dev_class, NULL, devt, dev, chrdrv_groups,
+						DEVICE_NAME "%u", index);
+	if (IS_ERR(dev->device)) {
+		pr_err("unable to create the device \n");
+		ret = PTR_ERR(dev->device);
+		goto device_fail;
+	}
+	return dev;
+
+device_fail:
+	cdev_del(&dev->cdev);
+cdev_fail:
+	chrdrv_ring_free(&dev->ring);
+ring_fail:
+	free_percpu(dev->stats);
+stats_fail:
+	percpu_free_rwsem(&dev->io_sem);
+sem_fail:
+	kfree(dev);
+	return ERR_PTR(ret);
+}
+
+/* Destroy a device instance created by chrdrv_dev_create() */
+static void chrdrv_dev_destroy(struct chrdrv_dev *dev)
+{
+	device_unregister(dev->device); // Destroy the device, without a class lookup
+	cdev_del(&dev->cdev); // delete the cdev
+	chrdrv_ring_free(&dev->ring); // Free the ring buffer pages
+	free_percpu(dev->stats);
+	percpu_free_rwsem(&dev->io_sem);
+	kfree(dev);
+}
+
+/*
+ * Instance bring-up and teardown on async workers. Each entry runs on the
+ * node of its instance; chrdrv_async_domain lets init and exit wait for
+ * their own entries only. If an entry cannot be queued, async_schedule
+ * runs it synchronously, so the result is the same either way.
+ */
+static ASYNC_DOMAIN_EXCLUSIVE(chrdrv_async_domain);
+
+static void chrdrv_dev_create_async(void *data, async_cookie_t cookie)
+{
+	unsigned int index = (unsigned long)data;
+
+	devs[index] = chrdrv_dev_create(index, buf_size); // ERR_PTR on failure
+}
+
+static void chrdrv_dev_destroy_async(void *data, async_cookie_t cookie)
+{
+	chrdrv_dev_destroy(data);
+}
+
+/*
+ * Create every instance, in parallel unless parallel_init is off. On
+ * failure the instances that were created are destroyed again and the
+ * first error is returned.
+ */
+static int chrdrv_devs_create(void)
+{
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < nr_devs; i++) {
+		if (!parallel_init) {
+			devs[i] = chrdrv_dev_create(i, buf_size);
+			if (IS_ERR(devs[i])) {
+				ret = PTR_ERR(devs[i]);
+				break;
+			}
+			continue;
+		}
+		async_schedule_node_domain(chrdrv_dev_create_async, (void *)(unsigned long)i,
+					   chrdrv_dev_node(i), &chrdrv_async_domain);
+	}
+	async_synchronize_full_domain(&chrdrv_async_domain);
+	if (parallel_init) {
+		for (i = 0; i < nr_devs; i++) {
+			if (IS_ERR(devs[i]) && !ret)
+				ret = PTR_ERR(devs[i]);
+		}
+	}
+	if (!ret)
+		return 0;
+
+	for (i = 0; i < nr_devs; i++) {
+		if (!IS_ERR_OR_NULL(devs[i]))
+			chrdrv_dev_destroy(devs[i]);
+		devs[i] = NULL;
+	}
+	return ret;
+}
+
+/* Destroy every instance, in parallel unless parallel_init is off */
+static void chrdrv_devs_destroy(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_devs; i++) {
+		if (parallel_init)
+			async_schedule_node_domain(chrdrv_dev_destroy_async, devs[i],
+						   chrdrv_dev_node(i), &chrdrv_async_domain);
+		else
+			chrdrv_dev_destroy(devs[i]);
+	}
+	async_synchronize_full_domain(&chrdrv_async_domain);
+}
+
 /* Init function for the module */
 static int __init hello_world_init(void)
 {
     int ret; // Variable for return values
-   
+    ktime_t start = ktime_get();
+
+    buf_size = chrdrv_buf_size(buf_size);
+    nr_devs = clamp_t(unsigned int, nr_devs, 1, MAX_DEVS);
+
 #if DYNAMIC
-    // Dynamically register the character device number
-    major_num = register_chrdev(0, DEVICE_NAME, &fops);
-    if(major_num<0)
+    // Dynamically allocate a range of nr_devs device numbers
+    ret = alloc_chrdev_region(&dev_num, 0, nr_devs, DEVICE_NAME);
+    if(ret<0)
     {
 	    pr_err("failed to register device number dynamically \n");
 	    return ret;
     }
 #else
-    // Static allocation of character device number
+    // Static allocation of character device numbers
     dev_num=MKDEV(MAJOR_NUM, MINOR_NUM);
-    ret=register_chrdev_region(dev_num, 1, DEVICE_NAME);
+    ret=register_chrdev_region(dev_num, nr_devs, DEVICE_NAME);
     if(ret<0)
     {
 	    pr_err("failed to register static device number \n");
@@ -65,102 +1133,1206 @@ static int __init hello_world_init(void)
     pr_info("static allocation Major:%d Minor:%d \n",MAJOR(dev_num),MINOR(dev_num));
 #endif
 
-    // Initialize the cdev structure and add it to the system
-    cdev_init(&new_cdev, &fops);
-    new_cdev.owner = THIS_MODULE;
-    ret = cdev_add(&new_cdev, MKDEV(major_num,0),1);
-    if(ret<0)
-    {
-	    pr_err("unable to create cdev add \n");
-	    goto cdev_fail;
-    }
-
     // Create a device class
     dev_class= class_create("new_class");
     if(IS_ERR(dev_class))
     {
 	    pr_err("unable to create the class \n");
+	    ret = PTR_ERR(dev_class);
 	    goto class_fail;
     }
 
-    // Create a device and associate it with the class
-    dev_device= device_create(dev_class, NULL, MKDEV(major_num, 0), NULL, "new_device");
-    if(IS_ERR(dev_device))
+    devs = kcalloc(nr_devs, sizeof(*devs), GFP_KERNEL);
+    if(!devs)
     {
-	    pr_err("unable to create the device \n");
-	    goto device_fail;
+	    ret = -ENOMEM;
+	    goto array_fail;
     }
 
-    // Allocate memory for the device buffer
-    if((local_buffer = kmalloc(mem_size, GFP_KERNEL))== 0)
+    // Create the device instances
+    ret = chrdrv_devs_create();
+    if(ret<0)
     {
-	    pr_err("cannot allocate memory");
+	    pr_err("unable to create the device instances \n");
+	    goto devs_fail;
+    }
+
+    ret = register_shrinker(&chrdrv_shrinker, "chrdrv");
+    if(ret<0)
+    {
+	    pr_err("unable to register the shrinker \n");
 	    goto device_fail;
     }
-    printk(KERN_INFO "Kernel Module Inserted Successfully...\n");
+
+    // Only now may a write to buf_size resize the instances
+    kernel_param_lock(THIS_MODULE);
+    devs_live = true;
+    kernel_param_unlock(THIS_MODULE);
+
+    printk(KERN_INFO "Kernel Module Inserted Successfully (%u devices, ring %u bytes, %lld us)...\n",
+	   nr_devs, buf_size, ktime_us_delta(ktime_get(), start));
     return 0;
 
 device_fail:
-    // Cleanup on device creation failure
+    // Cleanup the instances
+	chrdrv_devs_destroy();
+devs_fail:
+	kfree(devs);
+array_fail:
 	class_destroy(dev_class);
-cdev_fail:
-     cdev_del(&new_cdev);
 class_fail:
     // Cleanup on class creation failure
-	unregister_chrdev(major_num, DEVICE_NAME);
+	unregister_chrdev_region(dev_num, nr_devs);
 
-	return -1;
+	return ret;
 }
 
+/*
+ * Whether a record taking rec ring bytes can be queued right now, sampled
+ * without the device lock for the wait condition.
+ */
+static bool chrdrv_msg_fits(struct chrdrv_dev *dev, u32 rec)
+{
+	struct chrdrv_ring *ring = &dev->ring;
+	u32 msgs = READ_ONCE(ring->ctrl->msg_head) - READ_ONCE(ring->ctrl->msg_tail);
+
+	if (dev->msg_depth && msgs >= dev->msg_depth)
+		return false;
+	return ring->size - chrdrv_ring_count(ring) >= rec;
+}
+
+/*
+ * Discard the oldest record. Called with the device lock held. Returns -EIO
+ * if the ring does not hold a complete record, which only happens when a
+ * producer on the mapping broke the framing.
+ */
+static int chrdrv_msg_drop(struct chrdrv_dev *dev)
+{
+	struct chrdrv_ring *ring = &dev->ring;
+	u32 tail = READ_ONCE(ring->ctrl->tail);
+	u32 head = smp_load_acquire(&ring->ctrl->head);
+	size_t used = chrdrv_ring_used(ring, head, tail);
+	struct chrdrv_msg_hdr hdr;
+
+	if (used < sizeof(hdr))
+		return -EIO;
+	chrdrv_ring_read(ring, tail, &hdr, sizeof(hdr));
+	if (hdr.len > ring->size || CHRDRV_MSG_SIZE(hdr.len) > used)
+		return -EIO;
+
+	WRITE_ONCE(ring->ctrl->msg_tail, ring->ctrl->msg_tail + 1);
+	smp_store_release(&ring->ctrl->tail, tail + CHRDRV_MSG_SIZE(hdr.len));
+	chrdrv_stat_inc(dev, msgs_dropped);
+	return 0;
+}
+
+/*
+ * Make room for a record taking rec ring bytes, dropping the oldest records
+ * if that is the policy. Called with the device lock held. Returns -EAGAIN
+ * if the writer has to wait.
+ */
+static int chrdrv_msg_make_room(struct chrdrv_dev *dev, u32 rec)
+{
+	int ret;
+
+	while (!chrdrv_msg_fits(dev, rec)) {
+		if (dev->msg_policy != CHRDRV_MSG_DROP_OLDEST)
+			return -EAGAIN;
+		ret = chrdrv_msg_drop(dev);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Message mode read: return exactly one record. A buffer smaller than the
+ * next record gets -EMSGSIZE and the record stays queued.
+ */
+static ssize_t chrdrv_msg_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct chrdrv_dev *dev = chrdrv_file_dev(iocb->ki_filp);
+	struct chrdrv_ring *ring = &dev->ring;
+	bool nowait = chrdrv_nowait(iocb);
+	struct chrdrv_msg_hdr hdr;
+	size_t used, copied;
+	u32 head, tail, rec;
+	bool locked;
+	ssize_t ret;
+
+	for (;;) {
+		ret = chrdrv_lock(dev, &locked, nowait);
+		if (ret)
+			return ret;
+		tail = READ_ONCE(ring->ctrl->tail);
+		head = smp_load_acquire(&ring->ctrl->head); // Pairs with the producer's release of head
+		used = chrdrv_ring_used(ring, head, tail);
+		if (used)
+			break;
+		chrdrv_unlock(dev, locked);
+
+		if (nowait)
+			return -EAGAIN;
+		chrdrv_stat_inc(dev, waits);
+		if (wait_event_interruptible(dev->readq, chrdrv_ring_count(ring)))
+			return -ERESTARTSYS;
+	}
+
+	if (used < sizeof(hdr)) {
+		ret = -EIO;
+		goto out;
+	}
+	chrdrv_ring_read(ring, tail, &hdr, sizeof(hdr));
+	rec = CHRDRV_MSG_SIZE(hdr.len);
+	if (hdr.len > ring->size || rec > used) {
+		ret = -EIO; // Framing broken through the mapping
+		goto out;
+	}
+	if (hdr.len > iov_iter_count(to)) {
+		ret = -EMSGSIZE;
+		goto out;
+	}
+
+	copied = chrdrv_ring_copy_to_iter(ring, tail + sizeof(hdr), to, hdr.len);
+	if (copied != hdr.len) {
+		pr_debug("Data read error \n");
+		ret = -EFAULT;
+		goto out;
+	}
+	WRITE_ONCE(ring->ctrl->msg_tail, ring->ctrl->msg_tail + 1);
+	smp_store_release(&ring->ctrl->tail, tail + rec); // Hand the space back to the producer
+	iocb->ki_pos += copied;
+	ret = copied;
+out:
+	chrdrv_unlock(dev, locked);
+	if (ret >= 0)
+		chrdrv_wake(&dev->writeq, EPOLLOUT | EPOLLWRNORM);
+	return ret;
+}
+
+/*
+ * Message mode write: queue the whole request as one record, or nothing.
+ * When the queue is full the writer waits, or the oldest records are
+ * dropped, depending on the queue policy.
+ */
+static ssize_t chrdrv_msg_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct chrdrv_dev *dev = chrdrv_file_dev(iocb->ki_filp);
+	struct chrdrv_ring *ring = &dev->ring;
+	size_t len = iov_iter_count(from);
+	bool nowait = chrdrv_nowait(iocb);
+	struct chrdrv_msg_hdr hdr;
+	size_t copied;
+	u32 head, rec;
+	bool locked;
+	ssize_t ret;
+
+	if (len > ring->size - sizeof(hdr))
+		return -EMSGSIZE;
+	rec = CHRDRV_MSG_SIZE(len);
+
+	for (;;) {
+		ret = chrdrv_lock(dev, &locked, nowait);
+		if (ret)
+			return ret;
+		if (len > ring->size - sizeof(hdr)) {
+			ret = -EMSGSIZE; // The ring shrank meanwhile
+			break;
+		}
+		ret = chrdrv_msg_make_room(dev, rec);
+		if (ret != -EAGAIN)
+			break;
+		chrdrv_unlock(dev, locked);
+
+		if (nowait)
+			return -EAGAIN;
+		chrdrv_stat_inc(dev, waits);
+		if (wait_event_interruptible(dev->writeq, chrdrv_msg_fits(dev, rec)))
+			return -ERESTARTSYS;
+	}
+	if (ret)
+		goto out;
+
+	head = READ_ONCE(ring->ctrl->head);
+	ret = chrdrv_ring_prepare(ring, head, rec, nowait);
+	if (ret)
+		goto out;
+	hdr.len = len;
+	chrdrv_ring_write(ring, head, &hdr, sizeof(hdr));
+	copied = chrdrv_ring_copy_from_iter(ring, head + sizeof(hdr), from, len);
+	if (copied != len) {
+		pr_debug("Data write Error \n");
+		ret = -EFAULT; // Nothing was published
+		goto out;
+	}
+	WRITE_ONCE(ring->ctrl->msg_head, ring->ctrl->msg_head + 1);
+	smp_store_release(&ring->ctrl->head, head + rec); // Publish the record to the consumer
+	iocb->ki_pos += copied;
+	ret = copied;
+out:
+	chrdrv_unlock(dev, locked);
+	if (ret > 0)
+		chrdrv_wake(&dev->readq, EPOLLIN | EPOLLRDNORM);
+	return ret;
+}
+
+/*
+ * Fan-out mode: set the ring tail to the cursor of the slowest reader, or
+ * to head when there is none, handing the space before it back to writers.
+ * Called under dev->lock. Returns whether tail moved.
+ */
+static bool chrdrv_fanout_update_tail(struct chrdrv_dev *dev)
+{
+	struct chrdrv_ring *ring = &dev->ring;
+	u32 head = READ_ONCE(ring->ctrl->head);
+	struct chrdrv_file *f;
+	u32 lag = 0;
+
+	list_for_each_entry(f, &dev->readers, node)
+		lag = max(lag, head - f->cursor);
+	if (head - lag == READ_ONCE(ring->ctrl->tail))
+		return false;
+	smp_store_release(&ring->ctrl->tail, head - lag);
+	return true;
+}
+
+/*
+ * Fan-out mode: before want bytes are written at head, move every reader
+ * that would fall more than lag_limit bytes behind forward, dropping its
+ * oldest data, and flag it so that its next read fails with -EOVERFLOW.
+ * Without a lag limit the writer waits for the slowest reader instead.
+ * Called under dev->lock.
+ */
+static void chrdrv_fanout_make_room(struct chrdrv_dev *dev, u32 head, size_t want)
+{
+	u32 limit = min_t(size_t, dev->lag_limit, dev->ring.size);
+	struct chrdrv_file *f;
+
+	if (limit) {
+		list_for_each_entry(f, &dev->readers, node) {
+			if (head - f->cursor + want <= limit)
+				continue;
+			WRITE_ONCE(f->cursor, want < limit ? head + (u32)want - limit : head);
+			WRITE_ONCE(f->lagged, true);
+			chrdrv_stat_inc(dev, lag_skips);
+		}
+	}
+	chrdrv_fanout_update_tail(dev);
+}
+
+/* Whether a read on a file would find data, or an error, without waiting */
+static bool chrdrv_readable(struct chrdrv_file *f)
+{
+	struct chrdrv_dev *dev = f->dev;
+
+	if (READ_ONCE(dev->mode) != CHRDRV_MODE_FANOUT)
+		return chrdrv_ring_count(&dev->ring);
+	return READ_ONCE(f->lagged) || READ_ONCE(dev->ring.ctrl->head) != READ_ONCE(f->cursor);
+}
+
+/*
+ * Pages given to a pipe by dev_splice_read() belong to the pipe alone, so
+ * the generic helpers manage them: a reference per buffer, stealable by a
+ * consumer that wants to keep the page.
+ */
+static const struct pipe_buf_operations chrdrv_pipe_buf_ops = {
+	.release = generic_pipe_buf_release,
+	.try_steal = generic_pipe_buf_try_steal,
+	.get = generic_pipe_buf_get,
+};
+
 /* Function to handle device file open */
 static int dev_open(struct inode *inodep, struct file *filep)
 {
-	pr_info("New device file open function called \n");
-	return 0;
+	struct chrdrv_dev *dev = container_of(inodep->i_cdev, struct chrdrv_dev, cdev);
+	bool reader = filep->f_mode & FMODE_READ;
+	bool writer = filep->f_mode & FMODE_WRITE;
+	u64 start = ktime_get_ns();
+	struct chrdrv_file *f;
+	int ret = 0;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+	f->dev = dev;
+	INIT_LIST_HEAD(&f->node);
+
+	mutex_lock(&dev->lock);
+	if (dev->mode == CHRDRV_MODE_SPSC &&
+	    ((reader && dev->nr_readers) || (writer && dev->nr_writers))) {
+		ret = -EBUSY; // Only one reader and one writer in SPSC mode
+	} else {
+		dev->nr_readers += reader;
+		dev->nr_writers += writer;
+		if (reader) {
+			f->cursor = READ_ONCE(dev->ring.ctrl->head); // A fan-out reader starts with new data
+			list_add_tail(&f->node, &dev->readers);
+		}
+		filep->private_data = f;
+		filep->f_mode |= FMODE_NOWAIT; // io_uring may try inline, non-blocking I/O
+	}
+	mutex_unlock(&dev->lock);
+	if (ret)
+		kfree(f);
+	chrdrv_lat_record(dev, CHRDRV_LAT_OPEN, start);
+	trace_chrdrv_open(dev->index, ret);
+	return ret;
 }
 
 /* Function to handle device file release */
 static int dev_release(struct inode *inodep, struct file *filep)
 {
-	pr_info("New device file release function called \n");
+	struct chrdrv_file *f = filep->private_data;
+	struct chrdrv_dev *dev = f->dev;
+	bool freed = false;
+
+	mutex_lock(&dev->lock);
+	dev->nr_readers -= !!(filep->f_mode & FMODE_READ);
+	dev->nr_writers -= !!(filep->f_mode & FMODE_WRITE);
+	list_del(&f->node);
+	if (dev->mode == CHRDRV_MODE_FANOUT)
+		freed = chrdrv_fanout_update_tail(dev); // This may have been the slowest reader
+	mutex_unlock(&dev->lock);
+	if (freed)
+		chrdrv_wake(&dev->writeq, EPOLLOUT | EPOLLWRNORM);
+	kfree(f);
+	trace_chrdrv_release(dev->index, 0);
+	return 0;
+}
+
+/*
+ * Byte stream read. Copies up to iov_iter_count(to) unread bytes out of the
+ * ring into all the buffers of the request at once, advances the consumer
+ * position and ki_pos by the amount copied. Sleeps while the ring is empty,
+ * or returns -EAGAIN for O_NONBLOCK/IOCB_NOWAIT.
+ */
+static ssize_t chrdrv_stream_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct chrdrv_file *f = iocb->ki_filp->private_data;
+	struct chrdrv_dev *dev = f->dev;
+	struct chrdrv_ring *ring = &dev->ring;
+	size_t len = iov_iter_count(to);
+	bool nowait = chrdrv_nowait(iocb);
+	bool locked, fanout, freed = true;
+	size_t avail, copied;
+	u32 head, tail;
+	ssize_t ret;
+
+	for (;;) {
+		ret = chrdrv_lock(dev, &locked, nowait);
+		if (ret)
+			return ret;
+		fanout = locked && dev->mode == CHRDRV_MODE_FANOUT;
+		if (fanout && f->lagged) {
+			WRITE_ONCE(f->lagged, false);
+			ret = -EOVERFLOW; // Data was dropped, reading resumes after the gap
+			goto out;
+		}
+		tail = fanout ? f->cursor : READ_ONCE(ring->ctrl->tail);
+		head = smp_load_acquire(&ring->ctrl->head); // Pairs with the producer's release of head
+		avail = chrdrv_ring_used(ring, head, tail);
+		if (avail)
+			break;
+		chrdrv_unlock(dev, locked);
+
+		if (nowait)
+			return -EAGAIN;
+		chrdrv_stat_inc(dev, waits);
+		if (wait_event_interruptible(dev->readq, chrdrv_readable(f)))
+			return -ERESTARTSYS;
+	}
+
+	len = min(len, avail);
+	copied = chrdrv_ring_copy_to_iter(ring, tail, to, len); // Copy data to user space
+	if (!copied) {
+		pr_debug("Data read error \n");
+		ret = -EFAULT;
+		goto out;
+	}
+	if (fanout) {
+		WRITE_ONCE(f->cursor, tail + (u32)copied);
+		freed = chrdrv_fanout_update_tail(dev); // Space is free once the slowest reader is past it
+	} else {
+		smp_store_release(&ring->ctrl->tail, tail + (u32)copied); // Hand the space back to the producer
+	}
+	iocb->ki_pos += copied;
+	ret = copied;
+out:
+	chrdrv_unlock(dev, locked);
+	if (ret > 0 && freed)
+		chrdrv_wake(&dev->writeq, EPOLLOUT | EPOLLWRNORM);
+	return ret; // Return the size of the data read
+}
+
+/*
+ * Byte stream write. Appends up to iov_iter_count(from) bytes gathered from
+ * all the buffers of the request to the ring, limited by the free space, and
+ * advances ki_pos by the amount copied. Sleeps while the ring is full, or
+ * returns -EAGAIN for O_NONBLOCK/IOCB_NOWAIT.
+ */
+static ssize_t chrdrv_stream_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct chrdrv_dev *dev = chrdrv_file_dev(iocb->ki_filp);
+	struct chrdrv_ring *ring = &dev->ring;
+	size_t len = iov_iter_count(from);
+	bool nowait = chrdrv_nowait(iocb);
+	size_t space, copied;
+	u32 head, tail;
+	bool locked;
+	ssize_t ret;
+
+	for (;;) {
+		ret = chrdrv_lock(dev, &locked, nowait);
+		if (ret)
+			return ret;
+		head = READ_ONCE(ring->ctrl->head);
+		if (locked && dev->mode == CHRDRV_MODE_FANOUT)
+			chrdrv_fanout_make_room(dev, head, min(len, ring->size));
+		tail = smp_load_acquire(&ring->ctrl->tail); // Pairs with the consumer's release of tail
+		space = ring->size - chrdrv_ring_used(ring, head, tail);
+		if (space)
+			break;
+		chrdrv_unlock(dev, locked);
+
+		if (nowait)
+			return -EAGAIN;
+		chrdrv_stat_inc(dev, waits);
+		if (wait_event_interruptible(dev->writeq, chrdrv_ring_count(ring) < ring->size))
+			return -ERESTARTSYS;
+	}
+
+	len = min(len, space);
+	ret = chrdrv_ring_prepare(ring, head, len, nowait);
+	if (ret)
+		goto out;
+	copied = chrdrv_ring_copy_from_iter(ring, head, from, len); // Copy data from user space
+	if (!copied) {
+		pr_debug("Data write Error \n");
+		ret = -EFAULT;
+		goto out;
+	}
+	smp_store_release(&ring->ctrl->head, head + (u32)copied); // Publish the data to the consumer
+	iocb->ki_pos += copied;
+	ret = copied;
+out:
+	chrdrv_unlock(dev, locked);
+	if (ret > 0)
+		chrdrv_wake(&dev->readq, EPOLLIN | EPOLLRDNORM);
+	return ret; // Return the size of the data written
+}
+
+/* Record the latency of an operation that started at start (ktime_get_ns) */
+static void chrdrv_lat_record(struct chrdrv_dev *dev, enum chrdrv_lat_op op, u64 start)
+{
+	u64 ns = ktime_get_ns() - start;
+	unsigned int bucket = ns ? min_t(unsigned int, ilog2(ns), CHRDRV_LAT_BUCKETS - 1) : 0;
+
+	this_cpu_inc(dev->stats->lat[op][bucket]);
+}
+
+/*
+ * Function to handle read from the device in the current mode, see chrdrv.h.
+ * A zero length read wakes writers, for consumers working on the mapping.
+ */
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct chrdrv_dev *dev = chrdrv_file_dev(iocb->ki_filp);
+	size_t len = iov_iter_count(to);
+	loff_t pos = iocb->ki_pos;
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+
+	if (!len) {
+		chrdrv_wake(&dev->writeq, EPOLLOUT | EPOLLWRNORM);
+		return 0;
+	}
+
+	if (READ_ONCE(dev->mode) == CHRDRV_MODE_MSG)
+		ret = chrdrv_msg_read_iter(iocb, to);
+	else
+		ret = chrdrv_stream_read_iter(iocb, to);
+
+	if (ret >= 0) {
+		chrdrv_stat_inc(dev, reads);
+		chrdrv_stat_add(dev, bytes_read, ret);
+		if ((size_t)ret < len)
+			chrdrv_stat_inc(dev, short_reads);
+	} else if (ret == -EFAULT) {
+		chrdrv_stat_inc(dev, faults);
+	}
+	chrdrv_lat_record(dev, CHRDRV_LAT_READ, start);
+	trace_chrdrv_read(dev->index, len, pos, ret);
+	return ret;
+}
+
+/*
+ * Function to handle write to the device in the current mode, see chrdrv.h.
+ * A zero length write wakes readers, for producers working on the mapping.
+ */
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct chrdrv_dev *dev = chrdrv_file_dev(iocb->ki_filp);
+	size_t len = iov_iter_count(from);
+	loff_t pos = iocb->ki_pos;
+	u64 start = ktime_get_ns();
+	ssize_t ret;
+
+	if (!len) {
+		chrdrv_wake(&dev->readq, EPOLLIN | EPOLLRDNORM);
+		return 0;
+	}
+
+	if (READ_ONCE(dev->mode) == CHRDRV_MODE_MSG)
+		ret = chrdrv_msg_write_iter(iocb, from);
+	else
+		ret = chrdrv_stream_write_iter(iocb, from);
+
+	if (ret >= 0) {
+		chrdrv_stat_inc(dev, writes);
+		chrdrv_stat_add(dev, bytes_written, ret);
+	} else if (ret == -EFAULT) {
+		chrdrv_stat_inc(dev, faults);
+	}
+	chrdrv_lat_record(dev, CHRDRV_LAT_WRITE, start);
+	trace_chrdrv_write(dev->index, len, pos, ret);
+	return ret;
+}
+
+/* Function to report readiness to poll/select/epoll */
+static __poll_t dev_poll(struct file *filep, poll_table *wait)
+{
+	struct chrdrv_dev *dev = chrdrv_file_dev(filep);
+	struct chrdrv_ring *ring = &dev->ring;
+	__poll_t mask = 0;
+	size_t used;
+
+	poll_wait(filep, &dev->readq, wait);
+	poll_wait(filep, &dev->writeq, wait);
+
+	used = chrdrv_ring_count(ring);
+	if (chrdrv_readable(filep->private_data))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	switch (READ_ONCE(dev->mode)) {
+	case CHRDRV_MODE_MSG:
+		if (chrdrv_msg_fits(dev, CHRDRV_MSG_SIZE(1)))
+			mask |= EPOLLOUT | EPOLLWRNORM;
+		break;
+	case CHRDRV_MODE_FANOUT:
+		if (READ_ONCE(dev->lag_limit)) { // Slow readers are moved, never waited for
+			mask |= EPOLLOUT | EPOLLWRNORM;
+			break;
+		}
+		fallthrough;
+	default:
+		if (used < ring->size)
+			mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+	return mask;
+}
+
+/*
+ * splice()/sendfile() out of the device. In stream and SPSC mode whole
+ * unread pages are moved into the pipe without a copy: the ring gives the
+ * page away and the next write into that slot allocates a fresh one (see
+ * chrdrv_ring_page()). The page claim is taken for each page moved, so a
+ * long splice never keeps mmap() or a dma-buf export waiting. Partial
+ * pages, and pages of a ring that is mapped and so may still be written by
+ * user space, are copied into a new page. Other modes go through read_iter
+ * with copy_splice_read().
+ */
+static ssize_t dev_splice_read(struct file *filep, loff_t *ppos, struct pipe_inode_info *pipe,
+			       size_t len, unsigned int flags)
+{
+	struct chrdrv_file *f = filep->private_data;
+	struct chrdrv_dev *dev = f->dev;
+	struct chrdrv_ring *ring = &dev->ring;
+	bool nowait = (flags & SPLICE_F_NONBLOCK) || (filep->f_flags & O_NONBLOCK);
+	u64 start = ktime_get_ns();
+	loff_t pos = *ppos;
+	size_t avail, done = 0;
+	u32 head, tail;
+	bool locked;
+	ssize_t ret;
+
+	if (READ_ONCE(dev->mode) != CHRDRV_MODE_STREAM && READ_ONCE(dev->mode) != CHRDRV_MODE_SPSC)
+		return copy_splice_read(filep, ppos, pipe, len, flags);
+
+	for (;;) {
+		ret = chrdrv_lock(dev, &locked, nowait);
+		if (ret)
+			return ret;
+		if (locked && dev->mode != CHRDRV_MODE_STREAM) {
+			chrdrv_unlock(dev, locked); // Mode changed meanwhile
+			return copy_splice_read(filep, ppos, pipe, len, flags);
+		}
+		tail = READ_ONCE(ring->ctrl->tail);
+		head = smp_load_acquire(&ring->ctrl->head); // Pairs with the producer's release of head
+		avail = chrdrv_ring_used(ring, head, tail);
+		if (avail)
+			break;
+		chrdrv_unlock(dev, locked);
+
+		if (nowait)
+			return -EAGAIN;
+		chrdrv_stat_inc(dev, waits);
+		if (wait_event_interruptible(dev->readq, chrdrv_readable(f)))
+			return -ERESTARTSYS;
+	}
+
+	avail = min(len, avail);
+	while (done < avail && !pipe_full(pipe->head, pipe->tail, pipe->max_usage)) {
+		size_t off = (tail + done) & (ring->size - 1);
+		size_t chunk = min_t(size_t, avail - done, PAGE_SIZE - offset_in_page(off));
+		struct page **slot = &ring->pages[off >> PAGE_SHIFT];
+		struct pipe_buffer buf = { .ops = &chrdrv_pipe_buf_ops, .len = chunk };
+
+		if (!pipe->readers) { // add_to_pipe() would drop the page and its data
+			send_sig(SIGPIPE, current, 0);
+			ret = -EPIPE;
+			break;
+		}
+		if (chunk == PAGE_SIZE && *slot && !chrdrv_pages_claim(dev)) {
+			buf.page = *slot; // A whole unread page, hand it over
+			WRITE_ONCE(*slot, NULL);
+			set_page_private(buf.page, 0);
+			atomic_dec(&ring->nr_resident);
+			chrdrv_pages_unclaim(dev);
+		} else {
+			buf.page = alloc_page(nowait ? GFP_NOWAIT : GFP_KERNEL);
+			if (!buf.page) {
+				ret = nowait ? -EAGAIN : -ENOMEM;
+				break;
+			}
+			chrdrv_ring_read(ring, tail + done, page_address(buf.page), chunk);
+		}
+		add_to_pipe(pipe, &buf); // Readers and space checked, cannot fail
+		done += chunk;
+	}
+	if (done) {
+		smp_store_release(&ring->ctrl->tail, tail + (u32)done); // Hand the space back to the producer
+		*ppos += done;
+		ret = done;
+	} else if (!ret) {
+		ret = -EAGAIN; // The pipe was full
+	}
+	chrdrv_unlock(dev, locked);
+
+	if (done) {
+		chrdrv_wake(&dev->writeq, EPOLLOUT | EPOLLWRNORM);
+		chrdrv_stat_inc(dev, reads);
+		chrdrv_stat_add(dev, bytes_read, done);
+		if (done < len)
+			chrdrv_stat_inc(dev, short_reads);
+	}
+	chrdrv_lat_record(dev, CHRDRV_LAT_READ, start);
+	trace_chrdrv_read(dev->index, len, pos, ret);
+	return ret;
+}
+
+/*
+ * Function to switch the device mode. SPSC mode is only accepted while at
+ * most one file is open for reading and one for writing, which open() then
+ * keeps true. Message mode frames the ring differently, so entering or
+ * leaving it needs an empty ring and no file open besides the caller's.
+ * Entering fan-out mode gives every reader the unread data. SPSC I/O does
+ * not take dev->lock, so the switch also holds io_sem for writing, which
+ * waits for any lockless read or write still in flight.
+ */
+static int chrdrv_set_mode(struct chrdrv_dev *dev, struct file *filep, u32 mode)
+{
+	struct chrdrv_file *f;
+	unsigned int others;
+	int ret = 0;
+
+	if (mode != CHRDRV_MODE_STREAM && mode != CHRDRV_MODE_SPSC && mode != CHRDRV_MODE_MSG &&
+	    mode != CHRDRV_MODE_FANOUT)
+		return -EINVAL;
+
+	percpu_down_write(&dev->io_sem);
+	mutex_lock(&dev->lock);
+	others = dev->nr_readers + dev->nr_writers -
+		 !!(filep->f_mode & FMODE_READ) - !!(filep->f_mode & FMODE_WRITE);
+	if (mode == dev->mode)
+		goto out;
+	if (mode == CHRDRV_MODE_SPSC && (dev->nr_readers > 1 || dev->nr_writers > 1))
+		ret = -EBUSY;
+	else if ((mode == CHRDRV_MODE_MSG || dev->mode == CHRDRV_MODE_MSG) &&
+		 (others || chrdrv_ring_count(&dev->ring)))
+		ret = -EBUSY;
+	else
+		WRITE_ONCE(dev->mode, mode);
+	if (!ret && mode == CHRDRV_MODE_FANOUT) {
+		list_for_each_entry(f, &dev->readers, node) {
+			WRITE_ONCE(f->cursor, READ_ONCE(dev->ring.ctrl->tail));
+			WRITE_ONCE(f->lagged, false);
+		}
+	}
+out:
+	mutex_unlock(&dev->lock);
+	percpu_up_write(&dev->io_sem);
+	if (!ret) // Sleepers re-evaluate their wait condition under the new mode
+		chrdrv_wake(&dev->readq, EPOLLIN | EPOLLRDNORM);
+	return ret;
+}
+
+/*
+ * A dma-buf exported from the data pages of a ring. The export pins the
+ * page array like a mapping does, so the pages it hands out stay the
+ * ring's for as long as the dma-buf lives.
+ */
+struct chrdrv_export {
+	struct chrdrv_dev *dev; // Exporting instance
+	struct page **pages; // Data pages, all allocated at export
+	unsigned int nr_pages; // Number of data pages
+	struct mutex lock; // Guards attachments
+	struct list_head attachments; // struct chrdrv_attach of the importers
+};
+
+/* One importer of an exported ring */
+struct chrdrv_attach {
+	struct list_head node; // Entry in chrdrv_export.attachments
+	struct device *dev; // Importing device
+	struct sg_table *sgt; // Its DMA mapping, NULL while unmapped
+	enum dma_data_direction dir; // Direction of the mapping
+};
+
+static int chrdrv_dmabuf_attach(struct dma_buf *dmabuf, struct dma_buf_attachment *attach)
+{
+	struct chrdrv_export *exp = dmabuf->priv;
+	struct chrdrv_attach *a;
+
+	a = kzalloc(sizeof(*a), GFP_KERNEL);
+	if (!a)
+		return -ENOMEM;
+	a->dev = attach->dev;
+	attach->priv = a;
+	mutex_lock(&exp->lock);
+	list_add(&a->node, &exp->attachments);
+	mutex_unlock(&exp->lock);
 	return 0;
 }
 
-/* Function to handle read from the device */
-static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
+static void chrdrv_dmabuf_detach(struct dma_buf *dmabuf, struct dma_buf_attachment *attach)
+{
+	struct chrdrv_export *exp = dmabuf->priv;
+	struct chrdrv_attach *a = attach->priv;
+
+	mutex_lock(&exp->lock);
+	list_del(&a->node);
+	mutex_unlock(&exp->lock);
+	kfree(a);
+}
+
+/* Map the ring pages for DMA by an importing device */
+static struct sg_table *chrdrv_dmabuf_map(struct dma_buf_attachment *attach,
+					  enum dma_data_direction dir)
+{
+	struct chrdrv_export *exp = attach->dmabuf->priv;
+	struct chrdrv_attach *a = attach->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+	ret = sg_alloc_table_from_pages(sgt, exp->pages, exp->nr_pages, 0,
+					(size_t)exp->nr_pages << PAGE_SHIFT, GFP_KERNEL);
+	if (ret)
+		goto table_fail;
+	ret = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (ret)
+		goto map_fail;
+
+	mutex_lock(&exp->lock);
+	a->sgt = sgt;
+	a->dir = dir;
+	mutex_unlock(&exp->lock);
+	return sgt;
+
+map_fail:
+	sg_free_table(sgt);
+table_fail:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void chrdrv_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt,
+				enum dma_data_direction dir)
 {
-	pr_info("New device file read function called \n");
-	if(copy_to_user(buffer, local_buffer, mem_size)) // Copy data to user space
-	{
-		pr_err("Data read error \n");
+	struct chrdrv_export *exp = attach->dmabuf->priv;
+	struct chrdrv_attach *a = attach->priv;
+
+	mutex_lock(&exp->lock);
+	a->sgt = NULL;
+	mutex_unlock(&exp->lock);
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+/*
+ * CPU access brackets (DMA_BUF_IOCTL_SYNC from user space,
+ * dma_buf_begin/end_cpu_access() in the kernel). They hand the pages back
+ * and forth between the CPU and every device that has them mapped; on
+ * cache-coherent systems the syncs are no-ops.
+ */
+static int chrdrv_dmabuf_begin_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+	struct chrdrv_export *exp = dmabuf->priv;
+	struct chrdrv_attach *a;
+
+	mutex_lock(&exp->lock);
+	list_for_each_entry(a, &exp->attachments, node)
+		if (a->sgt)
+			dma_sync_sgtable_for_cpu(a->dev, a->sgt, a->dir);
+	mutex_unlock(&exp->lock);
+	return 0;
+}
+
+static int chrdrv_dmabuf_end_cpu_access(struct dma_buf *dmabuf, enum dma_data_direction dir)
+{
+	struct chrdrv_export *exp = dmabuf->priv;
+	struct chrdrv_attach *a;
+
+	mutex_lock(&exp->lock);
+	list_for_each_entry(a, &exp->attachments, node)
+		if (a->sgt)
+			dma_sync_sgtable_for_device(a->dev, a->sgt, a->dir);
+	mutex_unlock(&exp->lock);
+	return 0;
+}
+
+/* Map the exported pages into a process, through the dma-buf fd */
+static int chrdrv_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct chrdrv_export *exp = dmabuf->priv;
+	unsigned long addr = vma->vm_start;
+	unsigned long i;
+	int ret;
+
+	if (vma->vm_pgoff + vma_pages(vma) > exp->nr_pages)
+		return -EINVAL;
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	for (i = vma->vm_pgoff; addr < vma->vm_end; i++, addr += PAGE_SIZE) {
+		ret = vm_insert_page(vma, addr, exp->pages[i]);
+		if (ret)
+			return ret;
 	}
-	pr_info("Data readed successfully ..... \n");
+	return 0;
+}
+
+/* Contiguous kernel mapping of the exported pages, for importers that use the CPU */
+static int chrdrv_dmabuf_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+	struct chrdrv_export *exp = dmabuf->priv;
+	void *vaddr;
+
+	vaddr = vmap(exp->pages, exp->nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!vaddr)
+		return -ENOMEM;
+	iosys_map_set_vaddr(map, vaddr);
+	return 0;
+}
+
+static void chrdrv_dmabuf_vunmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+	vunmap(map->vaddr);
+}
+
+/* Last reference to the dma-buf dropped: unpin the ring */
+static void chrdrv_dmabuf_release(struct dma_buf *dmabuf)
+{
+	struct chrdrv_export *exp = dmabuf->priv;
 
-	return mem_size; // Return the size of the data read
+	chrdrv_pages_unpin(exp->dev);
+	kvfree(exp->pages);
+	kfree(exp);
 }
 
-/* Function to handle write to the device */
-static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset)
+static const struct dma_buf_ops chrdrv_dmabuf_ops = {
+	.attach = chrdrv_dmabuf_attach,
+	.detach = chrdrv_dmabuf_detach,
+	.map_dma_buf = chrdrv_dmabuf_map,
+	.unmap_dma_buf = chrdrv_dmabuf_unmap,
+	.begin_cpu_access = chrdrv_dmabuf_begin_cpu_access,
+	.end_cpu_access = chrdrv_dmabuf_end_cpu_access,
+	.mmap = chrdrv_dmabuf_mmap,
+	.vmap = chrdrv_dmabuf_vmap,
+	.vunmap = chrdrv_dmabuf_vunmap,
+	.release = chrdrv_dmabuf_release,
+};
+
+/*
+ * CHRDRV_IOC_EXPORT_DMABUF: export the data pages of the ring as a dma-buf
+ * and return its fd. Every page is allocated now, since importers map the
+ * whole buffer. The ring cannot be resized while an export lives.
+ */
+static int chrdrv_dmabuf_export(struct chrdrv_dev *dev, struct chrdrv_dmabuf __user *argp)
 {
-	pr_info("New device file write function called \n");
-	if(copy_from_user(local_buffer, buffer, len)) // Copy data from user space
-	{
-		pr_err("Data write Error \n");
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct chrdrv_ring *ring = &dev->ring;
+	struct chrdrv_export *exp;
+	struct chrdrv_dmabuf req;
+	struct dma_buf *dmabuf;
+	unsigned int i;
+	int ret;
+
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+	if (req.flags & ~(__u32)O_CLOEXEC)
+		return -EINVAL;
+
+	exp = kzalloc(sizeof(*exp), GFP_KERNEL);
+	if (!exp)
+		return -ENOMEM;
+	exp->dev = dev;
+	mutex_init(&exp->lock);
+	INIT_LIST_HEAD(&exp->attachments);
+
+	ret = chrdrv_pages_pin(dev);
+	if (ret)
+		goto pin_fail;
+	exp->nr_pages = ring->nr_pages; // Stable while pinned
+	exp->pages = kvmalloc_array(exp->nr_pages, sizeof(*exp->pages), GFP_KERNEL);
+	if (!exp->pages) {
+		ret = -ENOMEM;
+		goto pages_fail;
 	}
-	pr_info("Data written successfully");
-	return len; // Return the size of the data written
+	for (i = 0; i < exp->nr_pages; i++) {
+		exp->pages[i] = chrdrv_ring_page(ring, &ring->pages[i], GFP_KERNEL);
+		if (!exp->pages[i]) {
+			ret = -ENOMEM;
+			goto pages_fail;
+		}
+	}
+
+	exp_info.ops = &chrdrv_dmabuf_ops;
+	exp_info.size = (size_t)exp->nr_pages << PAGE_SHIFT;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = exp;
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		ret = PTR_ERR(dmabuf);
+		goto pages_fail;
+	}
+
+	ret = dma_buf_fd(dmabuf, req.flags & O_CLOEXEC);
+	if (ret < 0) {
+		dma_buf_put(dmabuf); // Releases exp and the pin
+		return ret;
+	}
+	req.fd = ret;
+	req.len = exp_info.size;
+	return copy_to_user(argp, &req, sizeof(req)) ? -EFAULT : 0;
+
+pages_fail:
+	kvfree(exp->pages); // The pages themselves stay in the ring
+	chrdrv_pages_unpin(dev);
+pin_fail:
+	kfree(exp);
+	return ret;
+}
+
+/*
+ * CHRDRV_IOC_IMPORT_DMABUF: loopback importer. Attach to any dma-buf, for
+ * example one exported by another instance, and write len bytes of it
+ * starting at offset into this ring as if they came from write(). The
+ * source is read through the exporter's kernel mapping inside a CPU access
+ * bracket, so the data never passes through user space.
+ */
+static int chrdrv_dmabuf_import(struct file *filep, struct chrdrv_dmabuf __user *argp)
+{
+	struct chrdrv_dmabuf req;
+	struct dma_buf *dmabuf;
+	struct iosys_map map;
+	struct iov_iter iter;
+	struct kiocb kiocb;
+	struct kvec kv;
+	ssize_t ret;
+
+	if (!(filep->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (copy_from_user(&req, argp, sizeof(req)))
+		return -EFAULT;
+
+	dmabuf = dma_buf_get(req.fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+	ret = -EINVAL;
+	if (req.offset > dmabuf->size)
+		goto put;
+	if (!req.len)
+		req.len = dmabuf->size - req.offset;
+	if (req.len > dmabuf->size - req.offset)
+		goto put;
+
+	ret = dma_buf_begin_cpu_access(dmabuf, DMA_FROM_DEVICE);
+	if (ret)
+		goto put;
+	ret = dma_buf_vmap_unlocked(dmabuf, &map);
+	if (ret)
+		goto end;
+	if (map.is_iomem) {
+		ret = -EOPNOTSUPP; // I/O memory would need memcpy_fromio()
+		goto unmap;
+	}
+
+	kv.iov_base = map.vaddr + req.offset;
+	kv.iov_len = req.len;
+	iov_iter_kvec(&iter, ITER_SOURCE, &kv, 1, req.len);
+	init_sync_kiocb(&kiocb, filep);
+	ret = dev_write_iter(&kiocb, &iter);
+unmap:
+	dma_buf_vunmap_unlocked(dmabuf, &map);
+end:
+	dma_buf_end_cpu_access(dmabuf, DMA_FROM_DEVICE);
+put:
+	dma_buf_put(dmabuf);
+	if (ret < 0)
+		return ret;
+	req.len = ret; // A stream write may take less than asked
+	return copy_to_user(argp, &req, sizeof(req)) ? -EFAULT : 0;
+}
+
+/* Function to handle ioctl commands, see chrdrv.h */
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+	struct chrdrv_dev *dev = chrdrv_file_dev(filep);
+	u32 __user *argp = (u32 __user *)arg;
+	struct chrdrv_msg_cfg cfg;
+	u32 val;
+
+	switch (cmd) {
+	case CHRDRV_IOC_SET_MODE:
+		if (get_user(val, argp))
+			return -EFAULT;
+		return chrdrv_set_mode(dev, filep, val);
+	case CHRDRV_IOC_GET_MODE:
+		return put_user((u32)READ_ONCE(dev->mode), argp);
+	case CHRDRV_IOC_SET_MSG_CFG:
+		if (copy_from_user(&cfg, argp, sizeof(cfg)))
+			return -EFAULT;
+		if (cfg.policy != CHRDRV_MSG_BLOCK && cfg.policy != CHRDRV_MSG_DROP_OLDEST)
+			return -EINVAL;
+		mutex_lock(&dev->lock);
+		dev->msg_depth = cfg.depth;
+		dev->msg_policy = cfg.policy;
+		mutex_unlock(&dev->lock);
+		chrdrv_wake(&dev->writeq, EPOLLOUT | EPOLLWRNORM); // A deeper queue may unblock writers
+		return 0;
+	case CHRDRV_IOC_GET_MSG_CFG:
+		cfg.depth = dev->msg_depth;
+		cfg.policy = dev->msg_policy;
+		return copy_to_user(argp, &cfg, sizeof(cfg)) ? -EFAULT : 0;
+	case CHRDRV_IOC_SET_LAG_LIMIT:
+		if (get_user(val, argp))
+			return -EFAULT;
+		mutex_lock(&dev->lock);
+		WRITE_ONCE(dev->lag_limit, val);
+		mutex_unlock(&dev->lock);
+		chrdrv_wake(&dev->writeq, EPOLLOUT | EPOLLWRNORM); // Writers need not wait any more
+		return 0;
+	case CHRDRV_IOC_GET_LAG_LIMIT:
+		return put_user(READ_ONCE(dev->lag_limit), argp);
+	case CHRDRV_IOC_EXPORT_DMABUF:
+		return chrdrv_dmabuf_export(dev, (struct chrdrv_dmabuf __user *)arg);
+	case CHRDRV_IOC_IMPORT_DMABUF:
+		return chrdrv_dmabuf_import(filep, (struct chrdrv_dmabuf __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Count the mappings of a ring, which must not be resized under them */
+static void chrdrv_vm_open(struct vm_area_struct *vma)
+{
+	struct chrdrv_dev *dev = vma->vm_private_data;
+
+	spin_lock(&dev->map_lock);
+	dev->nr_maps++;
+	spin_unlock(&dev->map_lock);
+}
+
+static void chrdrv_vm_close(struct vm_area_struct *vma)
+{
+	struct chrdrv_dev *dev = vma->vm_private_data;
+
+	chrdrv_pages_unpin(dev);
+}
+
+/* Map one page of the ring on first touch, allocating a data page not yet there */
+static vm_fault_t chrdrv_vm_fault(struct vm_fault *vmf)
+{
+	struct chrdrv_dev *dev = vmf->vma->vm_private_data;
+	struct chrdrv_ring *ring = &dev->ring;
+	struct page *page;
+
+	if (vmf->pgoff > ring->nr_pages)
+		return VM_FAULT_SIGBUS;
+	if (vmf->pgoff)
+		page = chrdrv_ring_page(ring, &ring->pages[vmf->pgoff - 1], GFP_KERNEL);
+	else
+		page = ring->ctrl_page;
+	if (!page)
+		return VM_FAULT_OOM;
+	get_page(page);
+	vmf->page = page;
+	return 0;
+}
+
+static const struct vm_operations_struct chrdrv_vm_ops = {
+	.open = chrdrv_vm_open,
+	.close = chrdrv_vm_close,
+	.fault = chrdrv_vm_fault,
+};
+
+/*
+ * Function to map the ring into user space. The mapping starts with the
+ * control page (struct chrdrv_ctrl) followed by the data pages, so a user
+ * space producer or consumer can move data without a system call. Pages
+ * are mapped as they are touched.
+ */
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+	struct chrdrv_dev *dev = chrdrv_file_dev(filep);
+	struct chrdrv_ring *ring = &dev->ring;
+	int ret;
+
+	if (!(vma->vm_flags & VM_SHARED)) // Private copies would never see new data
+		return -EINVAL;
+
+	ret = chrdrv_pages_pin(dev); // Counted from here on, so the pages stay put
+	if (ret)
+		return ret;
+
+	if (vma->vm_pgoff + vma_pages(vma) > ring->nr_pages + 1) {
+		chrdrv_pages_unpin(dev);
+		return -EINVAL;
+	}
+
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+	vma->vm_private_data = dev;
+	vma->vm_ops = &chrdrv_vm_ops;
+	return 0;
 }
 
 /* Exit function for the module */
 static void __exit hello_world_exit(void)
 {
-    kfree(local_buffer); // Free allocated memory
-    device_destroy(dev_class, MKDEV(major_num,0)); // Destroy the device
-    cdev_del(&new_cdev); // delete the cdev
-    class_unregister(dev_class); // Unregister the device class
+    ktime_t start = ktime_get();
+
+    // The parameter files outlive exit(); stop buf_size writes reaching the instances
+    kernel_param_lock(THIS_MODULE);
+    devs_live = false;
+    kernel_param_unlock(THIS_MODULE);
+
+    unregister_shrinker(&chrdrv_shrinker);
+    chrdrv_devs_destroy(); // Destroy every instance
+    kfree(devs);
     class_destroy(dev_class); // Destroy the device class
-    unregister_chrdev(major_num,DEVICE_NAME); // Unregister the character device
-    printk(KERN_INFO "Module Removed Successfully...\n");
+    unregister_chrdev_region(dev_num, nr_devs); // Release the device numbers
+    printk(KERN_INFO "Module Removed Successfully (%lld us)...\n",
+	   ktime_us_delta(ktime_get(), start));
 }
 
 /* Register init and exit functions */
@@ -172,3 +2344,4 @@ MODULE_LICENSE("GPL"); // License for the module
 MODULE_AUTHOR("collect and create"); // Author name
 MODULE_DESCRIPTION("character device driver"); // Module description
 MODULE_VERSION("2:1.0"); // Module version
+MODULE_IMPORT_NS(DMA_BUF); // dma_buf_get() and the importer helpers
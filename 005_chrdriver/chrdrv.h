@@ -0,0 +1,138 @@
+/*
+ * Definitions shared between the chrdrv kernel module and user space
+ * applications. Include this from both sides so the layouts always match.
+ */
+#ifndef CHRDRV_H
+#define CHRDRV_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Control header at offset 0 of an mmap() of the device. The ring data
+ * follows at data_offset. head and tail are free running byte counters:
+ * head - tail is the number of unread bytes and a position inside the data
+ * area is the counter masked with (size - 1).
+ *
+ * A producer writes data at head, then publishes it with a release store
+ * to head. A consumer reads data at tail, then frees it with a release
+ * store to tail. Each index sits on its own cache line so the producer and
+ * consumer never write the same line.
+ *
+ * Processes sleeping in read() or poll() are not woken by stores through
+ * the mapping. A producer kicks them with a zero length write(), and a
+ * consumer kicks blocked writers with a zero length read().
+ *
+ * In message mode the producer also increments msg_head for every record
+ * it publishes and the consumer increments msg_tail for every record it
+ * consumes, both before the release store of head/tail.
+ */
+struct chrdrv_ctrl {
+	__u32 head;		/* producer position */
+	__u32 msg_head;		/* records published (message mode) */
+	__u32 pad0[14];
+	__u32 tail;		/* consumer position */
+	__u32 msg_tail;		/* records consumed (message mode) */
+	__u32 pad1[14];
+	__u32 size;		/* size of the data area in bytes (power of two) */
+	__u32 data_offset;	/* offset of the data area in the mapping */
+};
+
+/*
+ * Device modes, selected with CHRDRV_IOC_SET_MODE.
+ *
+ * CHRDRV_MODE_STREAM: byte stream, any number of readers and writers,
+ * serialised by a per device mutex.
+ *
+ * CHRDRV_MODE_SPSC: byte stream for exactly one reader and one writer.
+ * read() and write() take no shared lock: the ring indices are handed over
+ * with acquire/release ordering only. Opening a second reader or writer fails
+ * with -EBUSY, and threads sharing one file must not read (or write)
+ * concurrently.
+ *
+ * CHRDRV_MODE_MSG: message queue. Each write() stores one record and each
+ * read() returns exactly one record; a buffer too small for the next
+ * record gets -EMSGSIZE and the record stays queued. Records are framed in
+ * the ring as a struct chrdrv_msg_hdr followed by the payload, padded to
+ * CHRDRV_MSG_ALIGN bytes. Queue depth and the full queue policy are set
+ * with CHRDRV_IOC_SET_MSG_CFG.
+ *
+ * CHRDRV_MODE_FANOUT: byte stream broadcast. Every file open for reading
+ * reads all the data, at its own cursor; a file opened in this mode starts
+ * with the data written after the open. Space is freed once the slowest
+ * reader has read it. With a lag limit (CHRDRV_IOC_SET_LAG_LIMIT) writers
+ * never wait: a reader that would fall further behind loses its oldest data
+ * and its next read() fails once with -EOVERFLOW. Without one, writers wait
+ * for the slowest reader. Consumers of an mmap() of the ring must not move
+ * tail in this mode.
+ *
+ * Switching into or out of message mode requires an empty ring and no
+ * other open file.
+ */
+enum chrdrv_mode {
+	CHRDRV_MODE_STREAM = 0,
+	CHRDRV_MODE_SPSC = 1,
+	CHRDRV_MODE_MSG = 2,
+	CHRDRV_MODE_FANOUT = 3,
+};
+
+/* Record header in message mode */
+struct chrdrv_msg_hdr {
+	__u32 len;		/* payload length in bytes */
+};
+
+#define CHRDRV_MSG_ALIGN 4
+/* Ring bytes taken by a record with a len byte payload */
+#define CHRDRV_MSG_SIZE(len) \
+	(((__u32)sizeof(struct chrdrv_msg_hdr) + (len) + CHRDRV_MSG_ALIGN - 1) & \
+	 ~(__u32)(CHRDRV_MSG_ALIGN - 1))
+
+/* What a message mode write() does when the queue is full */
+enum chrdrv_msg_policy {
+	CHRDRV_MSG_BLOCK = 0,		/* wait for room (or -EAGAIN) */
+	CHRDRV_MSG_DROP_OLDEST = 1,	/* discard the oldest records */
+};
+
+struct chrdrv_msg_cfg {
+	__u32 depth;		/* maximum queued records, 0 = bounded by ring size only */
+	__u32 policy;		/* enum chrdrv_msg_policy */
+};
+
+/*
+ * Argument of CHRDRV_IOC_EXPORT_DMABUF and CHRDRV_IOC_IMPORT_DMABUF.
+ *
+ * Export: the data area of the ring (without the control page) becomes a
+ * dma-buf. flags may hold O_CLOEXEC; fd and len return the dma-buf fd and
+ * its size. The fd can be passed to other processes and drivers and
+ * mmap()ed; bracket CPU access with DMA_BUF_IOCTL_SYNC on it. The ring
+ * keeps its head/tail in the control page of the device mapping, and
+ * cannot be resized while the dma-buf exists.
+ *
+ * Import: write len bytes (0 = to the end) of dma-buf fd, starting at
+ * offset, into the ring like a write() on the file. len returns the bytes
+ * written.
+ */
+struct chrdrv_dmabuf {
+	__s32 fd;
+	__u32 flags;
+	__u64 offset;
+	__u64 len;
+};
+
+#define CHRDRV_IOC_MAGIC 'N'
+
+/* Switch the device mode; fails with -EBUSY if the open files do not fit it */
+#define CHRDRV_IOC_SET_MODE _IOW(CHRDRV_IOC_MAGIC, 1, __u32)
+/* Read the current device mode */
+#define CHRDRV_IOC_GET_MODE _IOR(CHRDRV_IOC_MAGIC, 2, __u32)
+/* Set and read the message mode queue configuration */
+#define CHRDRV_IOC_SET_MSG_CFG _IOW(CHRDRV_IOC_MAGIC, 3, struct chrdrv_msg_cfg)
+#define CHRDRV_IOC_GET_MSG_CFG _IOR(CHRDRV_IOC_MAGIC, 4, struct chrdrv_msg_cfg)
+/* Set and read the fan-out lag limit in bytes, 0 = writers wait for the slowest reader */
+#define CHRDRV_IOC_SET_LAG_LIMIT _IOW(CHRDRV_IOC_MAGIC, 5, __u32)
+#define CHRDRV_IOC_GET_LAG_LIMIT _IOR(CHRDRV_IOC_MAGIC, 6, __u32)
+/* Export the ring as a dma-buf, and write a dma-buf into the ring */
+#define CHRDRV_IOC_EXPORT_DMABUF _IOWR(CHRDRV_IOC_MAGIC, 7, struct chrdrv_dmabuf)
+#define CHRDRV_IOC_IMPORT_DMABUF _IOWR(CHRDRV_IOC_MAGIC, 8, struct chrdrv_dmabuf)
+
+#endif /* CHRDRV_H */
@@ -0,0 +1,83 @@
+/*
+ * Tracepoints for the chrdrv file operations. They replace the printk lines
+ * on the open/release/read/write paths: a disabled tracepoint is a patched
+ * out branch, so they cost next to nothing until enabled with
+ *     echo 1 > /sys/kernel/tracing/events/chrdrv/enable
+ * or recorded with perf record -e 'chrdrv:*'.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM chrdrv
+
+#if !defined(_CHRDRV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CHRDRV_TRACE_H
+
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+/* open and release: caller and result */
+DECLARE_EVENT_CLASS(chrdrv_file,
+	TP_PROTO(unsigned int minor, int result),
+	TP_ARGS(minor, result),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(pid_t, pid)
+		__field(int, result)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->pid = current->pid;
+		__entry->result = result;
+	),
+	TP_printk("minor=%u pid=%d result=%d", __entry->minor, __entry->pid, __entry->result)
+);
+
+DEFINE_EVENT(chrdrv_file, chrdrv_open,
+	TP_PROTO(unsigned int minor, int result),
+	TP_ARGS(minor, result)
+);
+
+DEFINE_EVENT(chrdrv_file, chrdrv_release,
+	TP_PROTO(unsigned int minor, int result),
+	TP_ARGS(minor, result)
+);
+
+/* read and write: caller, requested length, file offset before the call and result */
+DECLARE_EVENT_CLASS(chrdrv_io,
+	TP_PROTO(unsigned int minor, size_t len, loff_t offset, ssize_t result),
+	TP_ARGS(minor, len, offset, result),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(pid_t, pid)
+		__field(size_t, len)
+		__field(loff_t, offset)
+		__field(ssize_t, result)
+	),
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->pid = current->pid;
+		__entry->len = len;
+		__entry->offset = offset;
+		__entry->result = result;
+	),
+	TP_printk("minor=%u pid=%d len=%zu offset=%lld result=%zd", __entry->minor, __entry->pid,
+		  __entry->len, __entry->offset, __entry->result)
+);
+
+DEFINE_EVENT(chrdrv_io, chrdrv_read,
+	TP_PROTO(unsigned int minor, size_t len, loff_t offset, ssize_t result),
+	TP_ARGS(minor, len, offset, result)
+);
+
+DEFINE_EVENT(chrdrv_io, chrdrv_write,
+	TP_PROTO(unsigned int minor, size_t len, loff_t offset, ssize_t result),
+	TP_ARGS(minor, len, offset, result)
+);
+
+#endif /* _CHRDRV_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE chrdrv_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,192 @@
+/* Two process check of the dma-buf export and the loopback importer */
+/*       GCC command to build the application
+        # gcc -O2 -o dmabuf_test dmabuf_test.c
+        # ./dmabuf_test [export device] [import device]
+
+   The parent exports the ring of the first device as a dma-buf, passes the
+   fd to a child over a Unix socket and writes a pattern with write(). The
+   child maps the dma-buf and checks the pattern between DMA_BUF_IOCTL_SYNC
+   brackets. If an import device is given, the child then imports the same
+   bytes into it with CHRDRV_IOC_IMPORT_DMABUF and the parent reads them
+   back from that device.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <linux/dma-buf.h>
+
+#include "chrdrv.h"
+
+#define DEVICE_PATH "/dev/new_device0"
+#define TEST_BYTES 8192 // Pattern length, spans more than one page
+
+/* Where the pattern went in the ring and how long it is */
+struct msg {
+    __u32 pos;
+    __u32 len;
+};
+
+/* Send fd over a Unix socket, with the message as payload */
+static int send_fd(int sock, int fd, const struct msg *m)
+{
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = (void *)m, .iov_len = sizeof(*m) };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = ctl, .msg_controllen = sizeof(ctl) };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    return sendmsg(sock, &mh, 0) == sizeof(*m) ? 0 : -1;
+}
+
+/* Receive an fd and the message sent with it */
+static int recv_fd(int sock, struct msg *m)
+{
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = m, .iov_len = sizeof(*m) };
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1,
+                         .msg_control = ctl, .msg_controllen = sizeof(ctl) };
+    struct cmsghdr *c;
+    int fd;
+
+    if (recvmsg(sock, &mh, 0) != sizeof(*m))
+        return -1;
+    c = CMSG_FIRSTHDR(&mh);
+    if (!c || c->cmsg_type != SCM_RIGHTS)
+        return -1;
+    memcpy(&fd, CMSG_DATA(c), sizeof(int));
+    return fd;
+}
+
+static unsigned char pattern(size_t i)
+{
+    return (unsigned char)(i * 7 + 3);
+}
+
+/* Child: map the dma-buf, check the pattern, optionally import it */
+static int child(int sock, const char *import_dev)
+{
+    struct dma_buf_sync sync = { .flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ };
+    struct chrdrv_dmabuf imp;
+    struct msg m;
+    unsigned char *buf;
+    off_t size;
+    size_t i;
+    int fd, dst, bad = 0;
+
+    fd = recv_fd(sock, &m);
+    if (fd < 0) {
+        perror("recvmsg");
+        return 1;
+    }
+    size = lseek(fd, 0, SEEK_END); // A dma-buf reports its size this way
+    buf = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (buf == MAP_FAILED) {
+        perror("mmap dma-buf");
+        return 1;
+    }
+
+    ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+    for (i = 0; i < m.len; i++)
+        bad += buf[(m.pos + i) & (size - 1)] != pattern(i);
+    sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+    ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+    printf("child: %u bytes through the dma-buf mapping, %d wrong\n", m.len, bad);
+    munmap(buf, size);
+
+    if (import_dev && !bad) {
+        dst = open(import_dev, O_WRONLY);
+        memset(&imp, 0, sizeof(imp));
+        imp.fd = fd;
+        imp.offset = m.pos & (size - 1);
+        imp.len = m.len;
+        if (imp.offset + imp.len > (__u64)size)
+            imp.len = size - imp.offset; // The pattern wrapped; import the first part
+        if (dst < 0 || ioctl(dst, CHRDRV_IOC_IMPORT_DMABUF, &imp) < 0) {
+            perror("CHRDRV_IOC_IMPORT_DMABUF");
+            return 1;
+        }
+        printf("child: imported %llu bytes into %s\n", (unsigned long long)imp.len, import_dev);
+        m.len = imp.len;
+        close(dst);
+    }
+    close(fd);
+    return write(sock, &m, sizeof(m)) == sizeof(m) && !bad ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : DEVICE_PATH;
+    const char *import_dev = argc > 2 ? argv[2] : NULL;
+    struct chrdrv_dmabuf exp = { .flags = O_CLOEXEC };
+    unsigned char buf[TEST_BYTES];
+    struct chrdrv_ctrl *ctrl;
+    struct msg m;
+    int sv[2], fd, src, status, bad = 0;
+    size_t i;
+    pid_t pid;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    if (ioctl(fd, CHRDRV_IOC_EXPORT_DMABUF, &exp) < 0) {
+        perror("CHRDRV_IOC_EXPORT_DMABUF");
+        return EXIT_FAILURE;
+    }
+    ctrl = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+    if (ctrl == MAP_FAILED) {
+        perror("mmap control page");
+        return EXIT_FAILURE;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        perror("socketpair");
+        return EXIT_FAILURE;
+    }
+    pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        return child(sv[1], import_dev);
+    }
+    close(sv[1]);
+
+    for (i = 0; i < TEST_BYTES; i++)
+        buf[i] = pattern(i);
+    m.pos = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+    m.len = write(fd, buf, TEST_BYTES);
+    if ((int)m.len <= 0 || send_fd(sv[0], exp.fd, &m) < 0) {
+        perror("write");
+        return EXIT_FAILURE;
+    }
+    close(exp.fd);
+
+    if (read(sv[0], &m, sizeof(m)) != sizeof(m)) {
+        waitpid(pid, &status, 0);
+        return EXIT_FAILURE;
+    }
+    if (import_dev) {
+        src = open(import_dev, O_RDONLY);
+        if (src < 0 || read(src, buf, m.len) != (ssize_t)m.len) {
+            perror(import_dev);
+            return EXIT_FAILURE;
+        }
+        for (i = 0; i < m.len; i++)
+            bad += buf[i] != pattern(i);
+        printf("parent: read back %u imported bytes, %d wrong\n", m.len, bad);
+        close(src);
+    }
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && !WEXITSTATUS(status) && !bad ? EXIT_SUCCESS : EXIT_FAILURE;
+}
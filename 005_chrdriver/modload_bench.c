@@ -0,0 +1,214 @@
+/* Load/unload time benchmark for modules that create many device nodes */
+/*       GCC command to build the application
+        # gcc -O2 -o modload_bench modload_bench.c
+
+   Loads and unloads the module --runs times for every instance count and
+   every --parallel setting and prints one CSV row per combination with the
+   min/median/max time spent in finit_module() and delete_module(), for
+   example
+
+        # ./modload_bench --module ./chrdrv.ko --counts 1,256,4096 --parallel 0,1
+
+   The count is passed as nr_devs=N and the parallel setting as
+   parallel_init=0/1, so the same tool times crdevfile.ko (which has no
+   parallel_init, leave --parallel out). --params appends further module
+   parameters. With --settle the tool also waits for udev to create the
+   /dev nodes after each load and reports that time separately, which is
+   what a boot that waits for its devices pays on top of the insertion.
+
+   Needs root, and the module must not be loaded already.
+*/
+
+#define _GNU_SOURCE // syscall()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#define MODULE_PATH "./chrdrv.ko"
+#define MAX_LIST 16 // Longest --counts/--parallel list
+#define MAX_RUNS 100 // Largest --runs
+
+/* Command line configuration */
+static struct {
+    const char *path;
+    const char *params;
+    char name[64]; // Module name, the file name without .ko
+    long counts[MAX_LIST];
+    int nr_counts;
+    long parallel[MAX_LIST];
+    int nr_parallel; // 0: do not pass parallel_init
+    int runs;
+    int settle;
+} cfg = {
+    .path = MODULE_PATH,
+    .params = "",
+    .runs = 5,
+};
+
+static long long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Sort the samples and print min,median,max */
+static void print_stats(long long *v, int n)
+{
+    qsort(v, n, sizeof(*v), cmp_ll);
+    printf(",%lld,%lld,%lld", v[0], v[n / 2], v[n - 1]);
+}
+
+/*
+ * One load/unload cycle. par < 0 leaves parallel_init out. Returns 0 and
+ * the three times in us, or -1 with errno set.
+ */
+static int cycle(long count, long par, long long *load, long long *settle, long long *unload)
+{
+    char params[512];
+    long long t;
+    int fd, ret;
+
+    if (par < 0)
+        snprintf(params, sizeof(params), "nr_devs=%ld %s", count, cfg.params);
+    else
+        snprintf(params, sizeof(params), "nr_devs=%ld parallel_init=%ld %s", count, par, cfg.params);
+
+    fd = open(cfg.path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    t = now_us();
+    ret = syscall(SYS_finit_module, fd, params, 0);
+    *load = now_us() - t;
+    close(fd);
+    if (ret < 0)
+        return -1;
+
+    *settle = 0;
+    if (cfg.settle) {
+        t = now_us();
+        if (system("udevadm settle") != 0)
+            fprintf(stderr, "udevadm settle failed\n");
+        *settle = now_us() - t;
+    }
+
+    t = now_us();
+    while ((ret = syscall(SYS_delete_module, cfg.name, O_NONBLOCK)) < 0 && errno == EAGAIN)
+        usleep(1000); // Something still holds a device open, udev probing for example
+    *unload = now_us() - t;
+    return ret;
+}
+
+static int parse_list(char *arg, long *out, int max)
+{
+    char *tok, *save;
+    int n = 0;
+
+    for (tok = strtok_r(arg, ",", &save); tok && n < max; tok = strtok_r(NULL, ",", &save))
+        out[n++] = strtol(tok, NULL, 0);
+    return n;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [--module PATH] [--counts N,...] [--parallel 0,1] [--runs N]\n"
+            "          [--params \"name=value ...\"] [--settle]\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        { "module", required_argument, NULL, 'm' },
+        { "counts", required_argument, NULL, 'c' },
+        { "parallel", required_argument, NULL, 'p' },
+        { "runs", required_argument, NULL, 'r' },
+        { "params", required_argument, NULL, 'a' },
+        { "settle", no_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 },
+    };
+    long long load[MAX_RUNS], settle[MAX_RUNS], unload[MAX_RUNS];
+    const char *base;
+    int opt, c, p, r, nr_par;
+    char *dot;
+
+    cfg.counts[0] = 1;
+    cfg.nr_counts = 1;
+
+    while ((opt = getopt_long(argc, argv, "m:c:p:r:a:s", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'm':
+            cfg.path = optarg;
+            break;
+        case 'c':
+            cfg.nr_counts = parse_list(optarg, cfg.counts, MAX_LIST);
+            break;
+        case 'p':
+            cfg.nr_parallel = parse_list(optarg, cfg.parallel, MAX_LIST);
+            break;
+        case 'r':
+            cfg.runs = atoi(optarg);
+            if (cfg.runs < 1 || cfg.runs > MAX_RUNS)
+                cfg.runs = 5;
+            break;
+        case 'a':
+            cfg.params = optarg;
+            break;
+        case 's':
+            cfg.settle = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The kernel names the module after its file; '-' reads as '_'
+    base = strrchr(cfg.path, '/');
+    snprintf(cfg.name, sizeof(cfg.name), "%s", base ? base + 1 : cfg.path);
+    dot = strstr(cfg.name, ".ko");
+    if (dot)
+        *dot = '\0';
+    for (dot = cfg.name; *dot; dot++)
+        if (*dot == '-')
+            *dot = '_';
+
+    printf("module,nr_devs,parallel,load_min_us,load_p50_us,load_max_us,"
+           "settle_min_us,settle_p50_us,settle_max_us,unload_min_us,unload_p50_us,unload_max_us\n");
+
+    nr_par = cfg.nr_parallel ? cfg.nr_parallel : 1;
+    for (c = 0; c < cfg.nr_counts; c++)
+        for (p = 0; p < nr_par; p++) {
+            long par = cfg.nr_parallel ? cfg.parallel[p] : -1;
+
+            for (r = 0; r < cfg.runs; r++) {
+                if (cycle(cfg.counts[c], par, &load[r], &settle[r], &unload[r]) < 0) {
+                    perror(cfg.path);
+                    return EXIT_FAILURE;
+                }
+            }
+            printf("%s,%ld,%ld", cfg.name, cfg.counts[c], par);
+            print_stats(load, cfg.runs);
+            print_stats(settle, cfg.runs);
+            print_stats(unload, cfg.runs);
+            printf("\n");
+            fflush(stdout);
+        }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,133 @@
+/* Contention benchmark: lock based vs lock free (SPSC) mode of the device */
+/*       GCC command to build the application
+        # gcc -O2 -pthread -o spsc_bench spsc_bench.c
+        # ./spsc_bench [device] [bytes per run]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "chrdrv.h"
+
+#define DEVICE_PATH "/dev/new_device0"
+#define RUN_BYTES (256UL << 20) // Bytes moved per message size and mode
+
+static const size_t msg_sizes[] = { 16, 64, 256, 1024, 4096, 16384 };
+
+struct worker {
+    int fd; // File open for the worker's direction
+    size_t msg_size; // Bytes per system call
+    size_t total; // Bytes to move
+    int failed; // Set when a system call fails
+};
+
+/* Monotonic time in seconds */
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Producer thread: write total bytes in msg_size pieces */
+static void *writer(void *arg)
+{
+    struct worker *w = arg;
+    char *buf = calloc(1, w->msg_size);
+    size_t done = 0;
+
+    while (buf && done < w->total) {
+        size_t len = w->total - done < w->msg_size ? w->total - done : w->msg_size;
+        ssize_t n = write(w->fd, buf, len);
+
+        if (n < 0) {
+            perror("write");
+            w->failed = 1;
+            break;
+        }
+        done += n;
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Consumer thread: read total bytes in msg_size pieces */
+static void *reader(void *arg)
+{
+    struct worker *w = arg;
+    char *buf = malloc(w->msg_size);
+    size_t done = 0;
+
+    while (buf && done < w->total) {
+        size_t len = w->total - done < w->msg_size ? w->total - done : w->msg_size;
+        ssize_t n = read(w->fd, buf, len);
+
+        if (n < 0) {
+            perror("read");
+            w->failed = 1;
+            break;
+        }
+        done += n;
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Run one writer and one reader in the given mode, print one result row */
+static int run(const char *path, __u32 mode, size_t msg_size, size_t total)
+{
+    struct worker wr = { .msg_size = msg_size, .total = total };
+    struct worker rd = { .msg_size = msg_size, .total = total };
+    pthread_t wt, rt;
+    double start, secs;
+
+    wr.fd = open(path, O_WRONLY);
+    rd.fd = open(path, O_RDONLY);
+    if (wr.fd < 0 || rd.fd < 0) {
+        perror("Failed to open the device");
+        return -1;
+    }
+    if (ioctl(wr.fd, CHRDRV_IOC_SET_MODE, &mode) < 0) {
+        perror("CHRDRV_IOC_SET_MODE");
+        return -1;
+    }
+
+    start = now_sec();
+    pthread_create(&wt, NULL, writer, &wr);
+    pthread_create(&rt, NULL, reader, &rd);
+    pthread_join(wt, NULL);
+    pthread_join(rt, NULL);
+    secs = now_sec() - start;
+
+    printf("%-6s %8zu %12.0f %10.1f\n", mode == CHRDRV_MODE_SPSC ? "spsc" : "locked",
+           msg_size, total / msg_size / secs, total / secs / 1e6);
+
+    mode = CHRDRV_MODE_STREAM; // Leave the device in its default mode
+    ioctl(wr.fd, CHRDRV_IOC_SET_MODE, &mode);
+    close(wr.fd);
+    close(rd.fd);
+    return wr.failed || rd.failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : DEVICE_PATH;
+    size_t total = argc > 2 ? strtoul(argv[2], NULL, 0) : RUN_BYTES;
+    size_t i;
+
+    printf("%-6s %8s %12s %10s\n", "mode", "msg", "msgs/s", "MB/s");
+    for (i = 0; i < sizeof(msg_sizes) / sizeof(msg_sizes[0]); i++) {
+        size_t n = total - total % msg_sizes[i]; // Whole messages only
+
+        if (run(path, CHRDRV_MODE_STREAM, msg_sizes[i], n) ||
+            run(path, CHRDRV_MODE_SPSC, msg_sizes[i], n))
+            return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -9,17 +9,164 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
 
-#define DEVICE_PATH "/dev/new_device"
+#include "chrdrv.h"
+
+#define DEVICE_PATH "/dev/new_device0"
 #define BUFFER_SIZE 256
+#define BENCH_BYTES (64UL << 20) // Bytes moved by each throughput test
+
+/* Monotonic time in seconds */
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Print the result of a throughput test */
+static void report(const char *path, size_t chunk, size_t bytes, double secs)
+{
+    printf("%-10s chunk %6zu: %zu bytes in %.3f s, %.1f MB/s\n",
+           path, chunk, bytes, secs, bytes / secs / 1e6);
+}
+
+/* Discard anything left in the device so the tests start from an empty ring */
+static void drain(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    char buf[4096];
+
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK); // An empty ring would block read()
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    fcntl(fd, F_SETFL, flags);
+}
+
+/* Throughput through the write()/read() system calls */
+static void bench_rw(int fd, size_t chunk)
+{
+    char *buf = calloc(1, chunk);
+    size_t moved = 0;
+    double start;
+
+    if (!buf)
+        return;
+    drain(fd);
+    start = now_sec();
+    while (moved < BENCH_BYTES) {
+        ssize_t w = write(fd, buf, chunk);
+        ssize_t r;
+
+        if (w < 0) {
+            perror("Failed to write to the device");
+            break;
+        }
+        r = read(fd, buf, w);
+        if (r < 0) {
+            perror("Failed to read from the device");
+            break;
+        }
+        moved += r;
+    }
+    report("read/write", chunk, moved, now_sec() - start);
+    free(buf);
+}
+
+/* Copy n bytes into the ring at position pos, wrapping at the end of the data area */
+static void ring_put(unsigned char *data, __u32 size, __u32 pos, const char *src, size_t n)
+{
+    __u32 off = pos & (size - 1);
+    size_t first = n < size - off ? n : size - off;
+
+    memcpy(data + off, src, first);
+    memcpy(data, src + first, n - first);
+}
+
+/* Copy n bytes out of the ring at position pos, wrapping at the end of the data area */
+static void ring_get(const unsigned char *data, __u32 size, __u32 pos, char *dst, size_t n)
+{
+    __u32 off = pos & (size - 1);
+    size_t first = n < size - off ? n : size - off;
+
+    memcpy(dst, data + off, first);
+    memcpy(dst + first, data, n - first);
+}
+
+/* Throughput through the shared mapping, without any system call per chunk */
+static void bench_mmap(int fd, size_t chunk)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    struct chrdrv_ctrl *ctrl;
+    unsigned char *data;
+    size_t map_len, moved = 0;
+    char *buf;
+    __u32 size;
+    double start;
+    void *map;
+
+    /* Map the control page alone first to learn the ring size */
+    map = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map the device");
+        return;
+    }
+    size = ((struct chrdrv_ctrl *)map)->size;
+    munmap(map, page);
+
+    map_len = page + size;
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map the device");
+        return;
+    }
+    ctrl = map;
+    data = (unsigned char *)map + ctrl->data_offset;
+
+    buf = calloc(1, chunk);
+    if (!buf) {
+        munmap(map, map_len);
+        return;
+    }
+    drain(fd);
+    start = now_sec();
+    while (moved < BENCH_BYTES) {
+        __u32 head = __atomic_load_n(&ctrl->head, __ATOMIC_RELAXED);
+        __u32 tail = __atomic_load_n(&ctrl->tail, __ATOMIC_ACQUIRE);
+        size_t n = size - (head - tail);
+
+        /* Produce one chunk */
+        if (n > chunk)
+            n = chunk;
+        ring_put(data, size, head, buf, n);
+        __atomic_store_n(&ctrl->head, head + n, __ATOMIC_RELEASE);
+
+        /* Consume everything that is available */
+        head = __atomic_load_n(&ctrl->head, __ATOMIC_ACQUIRE);
+        n = head - tail;
+        if (n > chunk)
+            n = chunk;
+        ring_get(data, size, tail, buf, n);
+        __atomic_store_n(&ctrl->tail, tail + n, __ATOMIC_RELEASE);
+        moved += n;
+    }
+    report("mmap", chunk, moved, now_sec() - start);
+    free(buf);
+    munmap(map, map_len);
+}
 
 int main() {
     int fd; // File descriptor for the device
     char read_buffer[BUFFER_SIZE];
     char write_buffer[BUFFER_SIZE];
     int choice;
+    size_t chunk;
 
     // Open the device file
+    fd = open(DEVICE_PATH, O_RDWR);
     if (fd < 0) {
         perror("Failed to open the device");
         return EXIT_FAILURE;
@@ -31,16 +178,18 @@ int main() {
         printf("\nChoose an operation:\n");
         printf("1. Write to device\n");
         printf("2. Read from device\n");
-        printf("3. Exit\n");
+        printf("3. Throughput test (read/write vs mmap)\n");
+        printf("4. Exit\n");
         printf("Enter your choice: ");
-        scanf("%d", &choice);
+        if (scanf("%d", &choice) != 1)
+            break;
 
         switch (choice) {
             case 1: // Write to the device
                 printf("Enter the data to write: ");
-                fd = open(DEVICE_PATH, O_RDWR);
                 getchar(); // Clear newline left by previous input
-                fgets(write_buffer, BUFFER_SIZE, stdin);
+                if (!fgets(write_buffer, BUFFER_SIZE, stdin))
+                    break;
                 write_buffer[strcspn(write_buffer, "\n")] = '\0'; // Remove trailing newline
 
                 ssize_t bytes_written = write(fd, write_buffer, strlen(write_buffer));
@@ -49,12 +198,10 @@ int main() {
                 } else {
                     printf("Data written to the device: %s\n", write_buffer);
                 }
-    		close(fd);
                 break;
 
             case 2: // Read from the device
                 memset(read_buffer, 0, BUFFER_SIZE); // Clear the buffer
-    		fd = open(DEVICE_PATH, O_RDWR);
                 ssize_t bytes_read = read(fd, read_buffer, BUFFER_SIZE - 1);
                 if (bytes_read < 0) {
                     perror("Failed to read from the device");
@@ -62,10 +209,17 @@ int main() {
                     read_buffer[bytes_read] = '\0'; // Null-terminate the buffer
                     printf("Data read from the device: %s\n", read_buffer);
                 }
-    		close(fd);
                 break;
 
-            case 3: // Exit
+            case 3: // Compare the copy path against the mapping
+                printf("Enter the chunk size in bytes: ");
+                if (scanf("%zu", &chunk) != 1 || chunk == 0)
+                    break;
+                bench_rw(fd, chunk);
+                bench_mmap(fd, chunk);
+                break;
+
+            case 4: // Exit
                 printf("Exiting...\n");
                 close(fd); // Close the device
                 return EXIT_SUCCESS;
@@ -6,30 +6,270 @@
 #include<linux/fs.h>
 #include<linux/cdev.h>
 #include<linux/slab.h>
-#include<linux/gpio.h>
+#include<linux/gpio/consumer.h>
+#include<linux/gpio/machine.h>
+#include<linux/platform_device.h>
+#include<linux/mod_devicetable.h>
+#include<linux/percpu.h>
+#include<linux/ktime.h>
+#include<linux/sysfs.h>
+#include<linux/interrupt.h>
+#include<linux/kfifo.h>
+#include<linux/spinlock.h>
+#include<linux/mutex.h>
+#include<linux/wait.h>
+#include<linux/poll.h>
+#include<linux/hrtimer.h>
+#include<linux/uaccess.h>
+#include<linux/workqueue.h>
+#include<linux/atomic.h>
+#include<linux/vmalloc.h>
+#include<linux/mm.h>
+#include<linux/log2.h>
+
+#include "gpiodrv.h"
+
+#define CREATE_TRACE_POINTS
+#include "gpiodrv_trace.h"
 
 /* Define constants */
 #define DYNAMIC 1 // Toggle for dynamic allocation of major number
 #define DEVICE_NAME "gpio_device" // Name of the device
 #define MAJOR_NUM 255 // Static major number
 #define MINOR_NUM 0 // Static minor number
-#define mem_size 1024 // Size of the memory buffer
-#define GPIO_OFFSET 512 // Offset for GPIO base
+#define EVENTS_NAME "gpio_events" // Name of the edge event device
+#define EVENTS_MINOR 1 // Minor number of the edge event device
+#define CAPTURE_NAME "gpio_capture" // Name of the sampling capture device
+#define CAPTURE_MINOR 2 // Minor number of the sampling capture device
+#define ASYNC_NAME "gpio_async" // Name of the asynchronous command device
+#define ASYNC_MINOR 3 // Minor number of the asynchronous command device
+#define NR_MINORS 4 // gpio_device, gpio_events, gpio_capture and gpio_async
+#define ASYNC_QUEUE 256 // Queued commands and completions per file, a power of two
+#define ASYNC_MERGE_MAX 32 // Commands merged into one line update
+#define EVENT_FIFO_SIZE 1024 // Queued edge events, must be a power of two
+#define BATCH_CHUNK 16 // Batched ioctl operations copied in per step
+#define PWM_MIN_NS 2000 // Shortest PWM high or low time, bounds the interrupt rate
+#define WAVE_SPIN_NS 20000 // Waveform delays below this are busy waited in the timer
+#define WAVE_SPIN_MAX_NS 100000 // Longest busy wait per timer callback
+#define WAVE_TICK_NS 200000 // Callback start to next callback after a busy wait, leaves the CPU half free
+#define CAPTURE_MIN_NS 1000 // Shortest sample period
+#define CAPTURE_SPIN_NS 20000 // Sample periods below this are sampled in bursts
+#define CAPTURE_BURST_NS 100000 // Length of a sampling burst
+#define CAPTURE_TICK_NS 200000 // Burst start to burst start, leaves the CPU half free
+#define DRIVER_NAME "gpiodrv" // Platform driver and device name
+#define DEFAULT_CHIP "pinctrl-bcm2835" // Label of the Raspberry Pi GPIO chip
 #define GPIO21 21 // GPIO pin number
+#define GPIODRV_MAX_LINES 32 // Lines per device, one bit each in the value mask
+
+/* Operations with a latency histogram */
+enum gpiodrv_lat_op {
+    GPIODRV_LAT_READ,
+    GPIODRV_LAT_WRITE,
+    GPIODRV_LAT_OPEN,
+    GPIODRV_LAT_PWM, // Lateness of PWM edges against their schedule
+    GPIODRV_LAT_WAVE, // Lateness of waveform timer callbacks
+    GPIODRV_LAT_OPS,
+};
+
+#define GPIODRV_LAT_BUCKETS 32 // Bucket i counts latencies in [2^i, 2^(i+1)) ns
+
+/* Driver statistics, one copy per CPU so the hot path never shares a cache line */
+struct gpiodrv_stats {
+    u64 reads; // Read calls
+    u64 writes; // Write calls
+    u64 bytes_written; // Bytes passed to write
+    u64 faults; // Failed user copies
+    u64 invalid; // Writes that are not a valid line mask
+    u64 ioctls; // ioctl calls
+    u64 ops; // Line operations applied by ioctl, batches count each one
+    u64 events; // Edge events queued
+    u64 events_dropped; // Edge events lost because the queue was full
+    u64 bounces; // Edges swallowed by software debounce
+    u64 wakeups_coalesced; // Events queued without a wakeup of their own
+    u64 async_cmds; // Asynchronous commands completed
+    u64 async_merged; // Asynchronous commands folded into an earlier one's update
+    u64 lat[GPIODRV_LAT_OPS][GPIODRV_LAT_BUCKETS]; // log2 latency histograms
+};
 
 /* Define global variables */
 static dev_t dev_num; // Device number
 static struct class *dev_class; // Device class
 static struct device *dev_device; // Device structure
 static struct cdev new_cdev; // Character device structure
-uint8_t *local_buffer; // Pointer for device memory buffer
 static int major_num; // Major number for dynamic allocation
+static struct gpiodrv_stats __percpu *gpio_stats; // Per CPU statistics
+
+/*
+ * Without a device tree node the module describes its own platform device:
+ * lines gpios[] and inputs[] are offsets on the chip labelled chip. An empty
+ * chip leaves the lines to the device tree ("out-gpios" and "in-gpios").
+ */
+static char *chip = DEFAULT_CHIP;
+module_param(chip, charp, 0444);
+MODULE_PARM_DESC(chip, "Label of the GPIO chip of gpios and inputs, empty to bind to a device tree node only");
+static int gpios[GPIODRV_MAX_LINES] = { GPIO21 };
+static int nr_gpios = 1;
+module_param_array(gpios, int, &nr_gpios, 0444);
+MODULE_PARM_DESC(gpios, "Output line offsets on chip, bit i of the value mask drives gpios[i] (default GPIO21)");
+
+/* Output lines, bit i of the value mask is line_descs[i] */
+static struct gpio_descs *out_descs; // From gpiod_get_array("out")
+static struct gpio_desc **line_descs; // out_descs->desc
+static int nr_lines; // out_descs->ndescs
+static u32 sleep_lines; // Lines on chips that may sleep
+static u32 out_state; // Level last driven on each line
+static u32 out_dir; // Lines configured as outputs
+static DEFINE_MUTEX(out_lock); // Serialises updates of out_state and out_dir
+
+static int inputs[GPIODRV_MAX_LINES];
+static int nr_input_params;
+module_param_array(inputs, int, &nr_input_params, 0444);
+MODULE_PARM_DESC(inputs, "Input line offsets on chip reporting edges on /dev/" EVENTS_NAME);
+
+/* Input lines reporting edges on /dev/gpio_events, line i of an event is in_descs->desc[i] */
+static struct gpio_descs *in_descs; // From gpiod_get_array_optional("in"), may be NULL
+static int nr_inputs;
+static bool in_sleep; // Some input sits on a chip that may sleep
+
+static unsigned int capture_size = 1 << 20;
+module_param(capture_size, uint, 0444);
+MODULE_PARM_DESC(capture_size, "Bytes of samples in the /dev/" CAPTURE_NAME " ring, rounded to a power of two");
+
+/* State of one input line */
+struct gpiodrv_input {
+    struct gpio_desc *desc; // Line descriptor
+    int irq; // Interrupt of the line
+    u32 line; // Index into in_descs
+    u64 timestamp; // Time of the last edge, taken in the hard IRQ handler
+    unsigned int debounce_us; // Debounce period, 0 when off
+    bool hw_debounce; // Debounced by the chip rather than debounce_work
+    bool bouncing; // Software debounce window open
+    int level; // Level reported by the last software debounced event
+    u64 burst_timestamp; // Time of the first edge in the debounce window
+    struct delayed_work debounce_work; // Ends the software debounce window
+};
+
+static struct gpiodrv_input input_lines[GPIODRV_MAX_LINES];
+static struct device *events_device; // /dev/gpio_events
+
+/*
+ * Queued edge events. kfifo needs no lock between one producer and one
+ * consumer; the producer lock only orders interrupts of different lines,
+ * which may run on different CPUs, and the consumer mutex orders readers.
+ */
+static DEFINE_KFIFO(event_fifo, struct gpiodrv_event, EVENT_FIFO_SIZE);
+static DEFINE_SPINLOCK(event_lock); // Serialises producers
+static DEFINE_MUTEX(event_read_lock); // Serialises consumers
+static DECLARE_WAIT_QUEUE_HEAD(event_wq); // Readers waiting for events
+static DEFINE_MUTEX(debounce_lock); // Serialises debounce configuration
+
+/*
+ * Event coalescing: with a window set, the first event after a wakeup arms
+ * coalesce_timer and readers are woken when it fires, so a burst of events
+ * costs one wakeup. A queue half full wakes them at once.
+ */
+static unsigned int coalesce_us; // Coalescing window, 0 wakes on every event
+static atomic_t coalesce_armed; // coalesce_timer pending
+static struct hrtimer coalesce_timer;
+
+/* Sampling capture, see struct gpiodrv_capture_ctrl */
+static struct {
+    struct hrtimer timer; // Samples, or starts a burst of samples
+    void *area; // vmalloc_user: control page, then the samples
+    struct gpiodrv_capture_ctrl *ctrl;
+    struct gpiodrv_capture_sample *samples;
+    u32 size; // Samples in the ring
+    u32 head; // Producer position, published in ctrl->head
+    u32 period_ns; // 0 when stopped
+    ktime_t start; // When sampling started
+    ktime_t stop; // When sampling stopped
+    u64 taken; // Samples stored
+    u64 overruns; // Samples dropped because the ring was full
+    u64 missed; // Sample times skipped between bursts or when late
+    struct mutex lock; // Serialises start, stop and read()
+    wait_queue_head_t wq; // Readers waiting for samples
+} capture;
+static struct device *capture_device; // /dev/gpio_capture
+
+/* Asynchronous command queue of one open /dev/gpio_async */
+struct gpiodrv_async {
+    DECLARE_KFIFO(cmds, struct gpiodrv_async_cmd, ASYNC_QUEUE); // Written by write(), read by work
+    DECLARE_KFIFO(done, struct gpiodrv_async_done, ASYNC_QUEUE); // Written by work, read by read()
+    struct mutex write_lock; // Serialises writers
+    struct mutex read_lock; // Serialises readers
+    struct work_struct work; // Applies the queued commands
+    wait_queue_head_t wq; // Readers and writers
+};
+
+static struct workqueue_struct *async_wq; // Runs the gpiodrv_async work items
+static struct device *async_device; // /dev/gpio_async
+
+/* Software PWM on one output line, toggled from a hard IRQ hrtimer */
+struct gpiodrv_pwm {
+    struct hrtimer timer; // Fires at every edge
+    u32 line; // Index into line_descs
+    u64 period_ns; // 0 when the line is not generating PWM
+    u64 duty_ns; // High time per period
+    bool level; // Level driven at the last edge
+    u64 edges; // Edges generated since configured
+    u64 max_jitter_ns; // Largest lateness of an edge since configured
+    u64 overruns; // Edges skipped because the timer fell a full step behind
+};
+
+static struct gpiodrv_pwm pwm_lines[GPIODRV_MAX_LINES];
+static DEFINE_MUTEX(pwm_lock); // Serialises PWM configuration
+
+/* States of a waveform slot */
+enum gpiodrv_wave_state {
+    WAVE_EMPTY,
+    WAVE_READY, // Queued or playing
+    WAVE_DONE, // Played, samples not yet freed
+};
+
+struct gpiodrv_wave_slot {
+    struct gpiodrv_sample *samples;
+    u32 count;
+    u32 seq; // Sequence number given to user space
+    enum gpiodrv_wave_state state;
+};
+
+/*
+ * Waveform player: two slots played alternately from a hard IRQ hrtimer.
+ * The lock is raw because it is taken in the timer; it also orders the
+ * timer's updates of out_state against process context.
+ */
+static struct {
+    struct hrtimer timer;
+    raw_spinlock_t lock;
+    struct gpiodrv_wave_slot slot[2];
+    unsigned int play; // Slot playing, or played last
+    u32 pos; // Next sample of the playing slot
+    bool running; // Timer armed
+    u32 submitted; // Sequence number of the last queued waveform
+    u32 completed; // Sequence number of the last finished waveform
+    wait_queue_head_t wq; // Waiting for a free slot or a completion
+    struct mutex queue_lock; // Serialises submitters
+} wave;
 
 /* Function prototypes */
 static int dev_open(struct inode *, struct file *);
 static int dev_release(struct inode *, struct file *);
 static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
 static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static long dev_ioctl(struct file *, unsigned int, unsigned long);
+static ssize_t events_read(struct file *, char __user *, size_t, loff_t *);
+static __poll_t events_poll(struct file *, poll_table *);
+static ssize_t capture_read(struct file *, char __user *, size_t, loff_t *);
+static __poll_t capture_poll(struct file *, poll_table *);
+static int capture_mmap(struct file *, struct vm_area_struct *);
+static long capture_ioctl(struct file *, unsigned int, unsigned long);
+static int async_open(struct inode *, struct file *);
+static int async_release(struct inode *, struct file *);
+static ssize_t async_read(struct file *, char __user *, size_t, loff_t *);
+static ssize_t async_write(struct file *, const char __user *, size_t, loff_t *);
+static __poll_t async_poll(struct file *, poll_table *);
+static void gpiodrv_wave_stop(void);
+static int gpiodrv_op(u32, u32 *);
 
 /* File operations structure */
 static struct file_operations fops = {
@@ -37,38 +277,845 @@ static struct file_operations fops = {
 	.open = dev_open,
 	.read = dev_read,
 	.write = dev_write,
+	.unlocked_ioctl = dev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 	.release = dev_release,
 };
 
-/* Initialize the driver */
-static int __init gpio_driver_init(void)
+/* File operations of /dev/gpio_events, installed by dev_open */
+static const struct file_operations event_fops = {
+	.owner = THIS_MODULE,
+	.read = events_read,
+	.poll = events_poll,
+	.release = dev_release,
+	.llseek = noop_llseek,
+};
+
+/* File operations of /dev/gpio_async, installed by dev_open */
+static const struct file_operations async_fops = {
+	.owner = THIS_MODULE,
+	.read = async_read,
+	.write = async_write,
+	.poll = async_poll,
+	.release = async_release,
+	.llseek = noop_llseek,
+};
+
+/* File operations of /dev/gpio_capture, installed by dev_open */
+static const struct file_operations capture_fops = {
+	.owner = THIS_MODULE,
+	.read = capture_read,
+	.poll = capture_poll,
+	.mmap = capture_mmap,
+	.unlocked_ioctl = capture_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.release = dev_release,
+	.llseek = noop_llseek,
+};
+
+/* Mask of all configured lines */
+static u32 gpiodrv_all_lines(void)
+{
+    return GENMASK(nr_lines - 1, 0);
+}
+
+/*
+ * Drive the output lines in which to their levels in values, bit i being
+ * line_descs[i]. Other lines are left alone, so PWM lines are not disturbed.
+ * gpiolib groups the descriptors by chip and calls each chip's set_multiple,
+ * so lines on one chip change in a single register write instead of one
+ * gpio_set_value per line; the whole array goes through the precomputed
+ * out_descs->info fast path. Lines on chips that never sleep use the atomic
+ * call, which skips the might_sleep checks. Called with out_lock held.
+ */
+static int gpiodrv_apply(u32 which, u32 values)
+{
+    struct gpio_desc *descs[GPIODRV_MAX_LINES];
+    unsigned long bits = 0; // Bitmap of GPIODRV_MAX_LINES <= BITS_PER_LONG bits
+    unsigned int n = 0;
+    int ret;
+    int i;
+
+    which &= out_dir;
+    for (i = 0; i < nr_lines; i++)
+    {
+        if (!(which & BIT(i)))
+            continue;
+        if (values & BIT(i))
+            __set_bit(n, &bits);
+        descs[n++] = line_descs[i];
+    }
+    if (!n)
+        return 0;
+    if (n == nr_lines)
+        ret = sleep_lines ?
+              gpiod_set_array_value_cansleep(n, line_descs, out_descs->info, &bits) :
+              gpiod_set_array_value(n, line_descs, out_descs->info, &bits);
+    else
+        ret = (which & sleep_lines) ?
+              gpiod_set_array_value_cansleep(n, descs, NULL, &bits) :
+              gpiod_set_array_value(n, descs, NULL, &bits);
+    if (ret == 0)
+    {
+        raw_spin_lock_irq(&wave.lock);
+        out_state = (out_state & ~which) | (values & which);
+        raw_spin_unlock_irq(&wave.lock);
+    }
+    return ret;
+}
+
+/* Drive every output line from mask at once */
+static int gpiodrv_set_mask(u32 mask)
+{
+    int ret;
+
+    mutex_lock(&out_lock);
+    ret = gpiodrv_apply(gpiodrv_all_lines(), mask);
+    mutex_unlock(&out_lock);
+    return ret;
+}
+
+/* Read every line at once into *mask, one register read per chip */
+static int gpiodrv_get_mask(u32 *mask)
+{
+    unsigned long values = 0;
+    int ret;
+
+    ret = gpiod_get_array_value_cansleep(nr_lines, line_descs, out_descs->info, &values);
+    if (ret)
+        return ret;
+    *mask = values;
+    return 0;
+}
+
+/* Wake the event readers, or leave it to coalesce_timer */
+static void gpiodrv_event_wake(void)
+{
+    unsigned int window = READ_ONCE(coalesce_us);
+
+    if (!window || kfifo_len(&event_fifo) >= EVENT_FIFO_SIZE / 2)
+    {
+        wake_up_interruptible_poll(&event_wq, EPOLLIN | EPOLLRDNORM);
+        return;
+    }
+    this_cpu_inc(gpio_stats->wakeups_coalesced);
+    if (!atomic_xchg(&coalesce_armed, 1))
+        hrtimer_start(&coalesce_timer, us_to_ktime(window), HRTIMER_MODE_REL_HARD);
+}
+
+static enum hrtimer_restart gpiodrv_coalesce_timer(struct hrtimer *timer)
+{
+    atomic_set(&coalesce_armed, 0);
+    wake_up_interruptible_poll(&event_wq, EPOLLIN | EPOLLRDNORM);
+    return HRTIMER_NORESTART;
+}
+
+/* Queue an edge of in at timestamp, value is the line level after the edge */
+static void gpiodrv_push_event(struct gpiodrv_input *in, u64 timestamp, int value)
+{
+    struct gpiodrv_event ev = {
+        .timestamp_ns = timestamp,
+        .line = in->line,
+        .edge = value ? GPIODRV_EDGE_RISING : GPIODRV_EDGE_FALLING,
+    };
+
+    if (kfifo_in_spinlocked(&event_fifo, &ev, 1, &event_lock))
+        this_cpu_inc(gpio_stats->events);
+    else
+        this_cpu_inc(gpio_stats->events_dropped);
+    gpiodrv_event_wake();
+}
+
+/*
+ * End of a software debounce window: report one edge, stamped with the
+ * first edge of the burst, if the line settled at a new level. A burst that
+ * settles back at the old level was only noise and reports nothing.
+ */
+static void gpiodrv_debounce_work(struct work_struct *work)
+{
+    struct gpiodrv_input *in = container_of(to_delayed_work(work), struct gpiodrv_input,
+                                            debounce_work);
+    int level;
+
+    WRITE_ONCE(in->bouncing, false);
+    level = gpiod_get_value_cansleep(in->desc);
+    if (level < 0 || level == in->level)
+    {
+        this_cpu_inc(gpio_stats->bounces);
+        return;
+    }
+    in->level = level;
+    gpiodrv_push_event(in, in->burst_timestamp, level);
+}
+
+/*
+ * Hard IRQ handler of an input line. The timestamp is taken here, as close
+ * to the edge as possible. Lines on a chip that can be read without sleeping
+ * are queued right away; others (I2C expanders, gpio-sim) are read from the
+ * IRQ thread.
+ */
+static irqreturn_t gpiodrv_edge_irq(int irq, void *data)
+{
+    struct gpiodrv_input *in = data;
+
+    unsigned int debounce_us = READ_ONCE(in->debounce_us);
+
+    in->timestamp = ktime_get_ns();
+    if (debounce_us && !in->hw_debounce)
+    {
+        /* Every edge in the window pushes its end out; only the last one counts */
+        if (!READ_ONCE(in->bouncing))
+        {
+            in->burst_timestamp = in->timestamp;
+            WRITE_ONCE(in->bouncing, true);
+        }
+        else
+            this_cpu_inc(gpio_stats->bounces);
+        mod_delayed_work(system_wq, &in->debounce_work, usecs_to_jiffies(debounce_us));
+        return IRQ_HANDLED;
+    }
+    if (gpiod_cansleep(in->desc))
+        return IRQ_WAKE_THREAD;
+    gpiodrv_push_event(in, in->timestamp, gpiod_get_value(in->desc));
+    return IRQ_HANDLED;
+}
+
+static irqreturn_t gpiodrv_edge_thread(int irq, void *data)
 {
+    struct gpiodrv_input *in = data;
+
+    gpiodrv_push_event(in, in->timestamp, gpiod_get_value_cansleep(in->desc));
+    return IRQ_HANDLED;
+}
+
+/* Release the first n input lines */
+static void gpiodrv_free_inputs(int n)
+{
+    while (n--)
+    {
+        free_irq(input_lines[n].irq, &input_lines[n]);
+        cancel_delayed_work_sync(&input_lines[n].debounce_work);
+    }
+    hrtimer_cancel(&coalesce_timer);
+}
+
+/* Request the both-edge interrupts of the input lines */
+static int gpiodrv_request_inputs(void)
+{
+    struct gpiodrv_input *in;
     int ret;
+    int i;
+
+    for (i = 0; i < nr_inputs; i++)
+    {
+        in = &input_lines[i];
+        in->desc = in_descs->desc[i];
+        in->line = i;
+        in->debounce_us = 0;
+        in->bouncing = false;
+        in->level = gpiod_get_value_cansleep(in->desc);
+        in->irq = gpiod_to_irq(in->desc);
+        ret = in->irq < 0 ? in->irq :
+              request_threaded_irq(in->irq, gpiodrv_edge_irq, gpiodrv_edge_thread,
+                                   IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
+                                   "gpiodrv", in);
+        if (ret)
+        {
+            pr_err("Can not request the interrupt of input %d \n", i);
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    gpiodrv_free_inputs(i);
+    return ret;
+}
+
+/* Add a duration of ns to the histogram of op */
+static void gpiodrv_hist_add(enum gpiodrv_lat_op op, u64 ns)
+{
+    unsigned int bucket = ns ? min_t(unsigned int, ilog2(ns), GPIODRV_LAT_BUCKETS - 1) : 0;
+
+    this_cpu_inc(gpio_stats->lat[op][bucket]);
+}
+
+/* Record the latency of an operation that started at start (ktime_get_ns) */
+static void gpiodrv_lat_record(enum gpiodrv_lat_op op, u64 start)
+{
+    gpiodrv_hist_add(op, ktime_get_ns() - start);
+}
+
+/*
+ * PWM edge. Runs in hard IRQ context, so the line must not sleep. The next
+ * edge is scheduled from the planned time of this one, not from now, so
+ * lateness does not accumulate; it is recorded as jitter instead.
+ */
+static enum hrtimer_restart gpiodrv_pwm_timer(struct hrtimer *timer)
+{
+    struct gpiodrv_pwm *pwm = container_of(timer, struct gpiodrv_pwm, timer);
+    ktime_t now = ktime_get();
+    ktime_t next;
+    s64 late;
+
+    pwm->level = !pwm->level;
+    gpiod_set_value(line_descs[pwm->line], pwm->level);
+
+    late = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(timer)));
+    if (late < 0)
+        late = 0;
+    gpiodrv_hist_add(GPIODRV_LAT_PWM, late);
+    if (late > pwm->max_jitter_ns)
+        pwm->max_jitter_ns = late;
+    pwm->edges++;
+
+    next = ktime_add_ns(hrtimer_get_expires(timer),
+                        pwm->level ? pwm->duty_ns : pwm->period_ns - pwm->duty_ns);
+    if (ktime_before(next, now))
+    {
+        /* Too far behind to keep the phase, restart the schedule from now */
+        pwm->overruns++;
+        next = ktime_add_ns(now, pwm->level ? pwm->duty_ns : pwm->period_ns - pwm->duty_ns);
+    }
+    hrtimer_set_expires(timer, next);
+    return HRTIMER_RESTART;
+}
+
+/* Stop PWM on a line and leave it low */
+static void gpiodrv_pwm_stop(struct gpiodrv_pwm *pwm)
+{
+    hrtimer_cancel(&pwm->timer);
+    if (pwm->period_ns)
+        gpiod_set_value(line_descs[pwm->line], 0);
+    pwm->period_ns = 0;
+}
+
+/*
+ * Configure PWM on line: period_ns 0 stops it, a duty of 0 or of the whole
+ * period holds the line low or high without a timer.
+ */
+static int gpiodrv_pwm_config(u32 line, u64 period_ns, u64 duty_ns)
+{
+    struct gpiodrv_pwm *pwm;
+
+    if (line >= nr_lines || !line_descs[line] || duty_ns > period_ns)
+        return -EINVAL;
+    /* The edges are driven from hard IRQ context */
+    if (sleep_lines & BIT(line))
+        return -EOPNOTSUPP;
+    if (period_ns && duty_ns && duty_ns < period_ns &&
+        (duty_ns < PWM_MIN_NS || period_ns - duty_ns < PWM_MIN_NS))
+        return -ERANGE;
+
+    pwm = &pwm_lines[line];
+    mutex_lock(&out_lock);
+    if (!(out_dir & BIT(line)))
+    {
+        mutex_unlock(&out_lock);
+        return -EINVAL;
+    }
+    mutex_lock(&pwm_lock);
+    gpiodrv_pwm_stop(pwm);
+    pwm->edges = 0;
+    pwm->max_jitter_ns = 0;
+    pwm->overruns = 0;
+    if (period_ns)
+    {
+        pwm->period_ns = period_ns;
+        pwm->duty_ns = duty_ns;
+        pwm->level = duty_ns != 0;
+        gpiod_set_value(line_descs[line], pwm->level);
+        if (duty_ns && duty_ns < period_ns)
+            hrtimer_start(&pwm->timer, ktime_add_ns(ktime_get(), duty_ns),
+                          HRTIMER_MODE_ABS_HARD);
+    }
+    mutex_unlock(&pwm_lock);
+    mutex_unlock(&out_lock);
+    return 0;
+}
+
+/* Store one sample in the capture ring, or count an overrun */
+static void gpiodrv_capture_put(unsigned long levels, ktime_t now)
+{
+    struct gpiodrv_capture_sample *sample;
+    u32 head = capture.head;
+
+    if (head - smp_load_acquire(&capture.ctrl->tail) >= capture.size)
+    {
+        capture.overruns++;
+        return;
+    }
+    sample = &capture.samples[head & (capture.size - 1)];
+    sample->levels = levels;
+    sample->time_ns = (u32)ktime_to_ns(now);
+    capture.head = head + 1;
+    smp_store_release(&capture.ctrl->head, capture.head);
+    capture.taken++;
+}
+
+/*
+ * Sampling timer, hard IRQ context. Periods of CAPTURE_SPIN_NS and more
+ * take one sample per callback. Shorter ones busy wait between samples for
+ * a burst of CAPTURE_BURST_NS and pause until CAPTURE_TICK_NS after its
+ * start, so a single core Pi keeps half its time; the sample times in the
+ * pause are counted as missed. All due times derive from the first one.
+ */
+static enum hrtimer_restart gpiodrv_capture_timer(struct hrtimer *timer)
+{
+    u64 period = capture.period_ns;
+    ktime_t next = hrtimer_get_expires(timer);
+    ktime_t start = ktime_get();
+    ktime_t now = start;
+    unsigned long levels;
+    u64 skip;
+
+    for (;;)
+    {
+        levels = 0;
+        gpiod_get_array_value(nr_inputs, in_descs->desc, in_descs->info, &levels);
+        gpiodrv_capture_put(levels, now);
+        next = ktime_add_ns(next, period);
+        if (period >= CAPTURE_SPIN_NS)
+            break;
+        if (ktime_to_ns(ktime_sub(next, start)) >= CAPTURE_BURST_NS)
+        {
+            now = ktime_add_ns(start, CAPTURE_TICK_NS);
+            break;
+        }
+        while (ktime_before(now = ktime_get(), next))
+            cpu_relax();
+    }
+    if (period >= CAPTURE_SPIN_NS)
+        now = ktime_get();
+
+    /* Skip the sample times that passed (or fall in the pause) */
+    if (ktime_before(next, now))
+    {
+        skip = div64_u64(ktime_to_ns(ktime_sub(now, next)) + period - 1, period);
+        capture.missed += skip;
+        next = ktime_add_ns(next, skip * period);
+    }
+    if (wq_has_sleeper(&capture.wq))
+        wake_up_interruptible_poll(&capture.wq, EPOLLIN | EPOLLRDNORM);
+    hrtimer_set_expires(timer, next);
+    return HRTIMER_RESTART;
+}
+
+/* Stop sampling; the samples stay in the ring */
+static void gpiodrv_capture_stop(void)
+{
+    hrtimer_cancel(&capture.timer);
+    if (capture.period_ns)
+        capture.stop = ktime_get();
+    capture.period_ns = 0;
+    wake_up_interruptible_poll(&capture.wq, EPOLLIN | EPOLLRDNORM);
+}
+
+/* Empty the ring and sample every period_ns. Called with capture.lock */
+static int gpiodrv_capture_start(u32 period_ns)
+{
+    if (!capture.area)
+        return -ENODEV;
+    /* The sampler reads the lines from hard IRQ context */
+    if (in_sleep)
+        return -EOPNOTSUPP;
+    if (period_ns < CAPTURE_MIN_NS)
+        return -ERANGE;
+
+    gpiodrv_capture_stop();
+    capture.head = 0;
+    WRITE_ONCE(capture.ctrl->head, 0);
+    WRITE_ONCE(capture.ctrl->tail, 0);
+    capture.ctrl->period_ns = period_ns;
+    capture.taken = 0;
+    capture.overruns = 0;
+    capture.missed = 0;
+    capture.period_ns = period_ns;
+    capture.start = ktime_get();
+    hrtimer_start(&capture.timer, capture.start, HRTIMER_MODE_ABS_HARD);
+    return 0;
+}
+
+/* Allocate the capture ring, capture_size bytes of samples after a control page */
+static int gpiodrv_capture_alloc(void)
+{
+    unsigned long bytes = roundup_pow_of_two(clamp_t(unsigned int, capture_size, PAGE_SIZE, 1 << 28));
+
+    capture.area = vmalloc_user(PAGE_SIZE + bytes);
+    if (!capture.area)
+        return -ENOMEM;
+    capture.ctrl = capture.area;
+    capture.samples = capture.area + PAGE_SIZE;
+    capture.size = bytes / sizeof(struct gpiodrv_capture_sample);
+    capture.ctrl->size = capture.size;
+    capture.ctrl->data_offset = PAGE_SIZE;
+    capture.ctrl->lines = nr_inputs;
+    return 0;
+}
+
+static void gpiodrv_capture_free(void)
+{
+    gpiodrv_capture_stop();
+    vfree(capture.area); // Pages still mapped stay until unmapped
+    capture.area = NULL;
+}
+
+/* Stop PWM on every line */
+static void gpiodrv_pwm_stop_all(void)
+{
+    int i;
+
+    mutex_lock(&pwm_lock);
+    for (i = 0; i < nr_lines; i++)
+        gpiodrv_pwm_stop(&pwm_lines[i]);
+    mutex_unlock(&pwm_lock);
+}
+
+/* Sum one counter over all CPUs; offset is its offset in struct gpiodrv_stats */
+static u64 gpiodrv_stat_sum(size_t offset)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += *(u64 *)((char *)per_cpu_ptr(gpio_stats, cpu) + offset);
+    return sum;
+}
+
+/* sysfs attribute showing one counter, /sys/class/new_class/gpio_device/stats/<field> */
+#define GPIODRV_STAT_ATTR(field)						\
+static ssize_t field##_show(struct device *d, struct device_attribute *attr,	\
+                            char *buf)						\
+{										\
+    return sysfs_emit(buf, "%llu\n",						\
+                      gpiodrv_stat_sum(offsetof(struct gpiodrv_stats, field)));	\
+}										\
+static DEVICE_ATTR_RO(field)
+
+GPIODRV_STAT_ATTR(reads);
+GPIODRV_STAT_ATTR(writes);
+GPIODRV_STAT_ATTR(bytes_written);
+GPIODRV_STAT_ATTR(faults);
+GPIODRV_STAT_ATTR(invalid);
+GPIODRV_STAT_ATTR(ioctls);
+GPIODRV_STAT_ATTR(ops);
+GPIODRV_STAT_ATTR(events);
+GPIODRV_STAT_ATTR(events_dropped);
+GPIODRV_STAT_ATTR(bounces);
+GPIODRV_STAT_ATTR(wakeups_coalesced);
+GPIODRV_STAT_ATTR(async_cmds);
+GPIODRV_STAT_ATTR(async_merged);
+
+/* Show a latency histogram as GPIODRV_LAT_BUCKETS counts, bucket i = [2^i, 2^(i+1)) ns */
+static ssize_t gpiodrv_lat_show(char *buf, enum gpiodrv_lat_op op)
+{
+    int len = 0;
+    int i;
+
+    for (i = 0; i < GPIODRV_LAT_BUCKETS; i++)
+        len += sysfs_emit_at(buf, len, "%llu%c",
+                             gpiodrv_stat_sum(offsetof(struct gpiodrv_stats, lat) +
+                                              (op * GPIODRV_LAT_BUCKETS + i) * sizeof(u64)),
+                             i == GPIODRV_LAT_BUCKETS - 1 ? '\n' : ' ');
+    return len;
+}
+
+static ssize_t read_latency_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    return gpiodrv_lat_show(buf, GPIODRV_LAT_READ);
+}
+static DEVICE_ATTR_RO(read_latency);
+
+static ssize_t write_latency_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    return gpiodrv_lat_show(buf, GPIODRV_LAT_WRITE);
+}
+static DEVICE_ATTR_RO(write_latency);
+
+static ssize_t open_latency_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    return gpiodrv_lat_show(buf, GPIODRV_LAT_OPEN);
+}
+static DEVICE_ATTR_RO(open_latency);
+
+static ssize_t wave_jitter_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    return gpiodrv_lat_show(buf, GPIODRV_LAT_WAVE);
+}
+static DEVICE_ATTR_RO(wave_jitter);
+
+static ssize_t pwm_jitter_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    return gpiodrv_lat_show(buf, GPIODRV_LAT_PWM);
+}
+static DEVICE_ATTR_RO(pwm_jitter);
+
+/* Writing anything to stats/reset clears all counters and histograms */
+static ssize_t reset_store(struct device *d, struct device_attribute *attr,
+                           const char *buf, size_t count)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(gpio_stats, cpu), 0, sizeof(struct gpiodrv_stats));
+    return count;
+}
+static DEVICE_ATTR_WO(reset);
+
+static struct attribute *gpiodrv_stats_attrs[] = {
+    &dev_attr_reads.attr,
+    &dev_attr_writes.attr,
+    &dev_attr_bytes_written.attr,
+    &dev_attr_faults.attr,
+    &dev_attr_invalid.attr,
+    &dev_attr_ioctls.attr,
+    &dev_attr_ops.attr,
+    &dev_attr_events.attr,
+    &dev_attr_events_dropped.attr,
+    &dev_attr_bounces.attr,
+    &dev_attr_wakeups_coalesced.attr,
+    &dev_attr_async_cmds.attr,
+    &dev_attr_async_merged.attr,
+    &dev_attr_read_latency.attr,
+    &dev_attr_write_latency.attr,
+    &dev_attr_open_latency.attr,
+    &dev_attr_pwm_jitter.attr,
+    &dev_attr_wave_jitter.attr,
+    &dev_attr_reset.attr,
+    NULL,
+};
+
+static const struct attribute_group gpiodrv_stats_group = {
+    .name = "stats",
+    .attrs = gpiodrv_stats_attrs,
+};
+
+/*
+ * /sys/class/new_class/gpio_device/pwm: writing "line period_ns duty_ns"
+ * starts PWM on output line (period 0 stops it); reading lists the active
+ * lines as "line period_ns duty_ns edges max_jitter_ns overruns".
+ */
+static ssize_t pwm_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct gpiodrv_pwm *pwm;
+    int len = 0;
+    int i;
+
+    mutex_lock(&pwm_lock);
+    for (i = 0; i < nr_lines; i++)
+    {
+        pwm = &pwm_lines[i];
+        if (pwm->period_ns)
+            len += sysfs_emit_at(buf, len, "%d %llu %llu %llu %llu %llu\n", i,
+                                 pwm->period_ns, pwm->duty_ns, pwm->edges,
+                                 pwm->max_jitter_ns, pwm->overruns);
+    }
+    mutex_unlock(&pwm_lock);
+    return len;
+}
+
+static ssize_t pwm_store(struct device *d, struct device_attribute *attr,
+                         const char *buf, size_t count)
+{
+    u64 period_ns, duty_ns;
+    u32 line;
+    int ret;
+
+    if (sscanf(buf, "%u %llu %llu", &line, &period_ns, &duty_ns) != 3)
+        return -EINVAL;
+    ret = gpiodrv_pwm_config(line, period_ns, duty_ns);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(pwm);
+
+/*
+ * /sys/class/new_class/gpio_device/debounce: writing "line usecs" debounces
+ * input line (0 turns it off), in the chip when it supports it and with a
+ * delayed work otherwise; reading lists "line usecs hw|sw" per debounced line.
+ */
+static ssize_t debounce_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    struct gpiodrv_input *in;
+    int len = 0;
+    int i;
+
+    mutex_lock(&debounce_lock);
+    for (i = 0; i < nr_inputs; i++)
+    {
+        in = &input_lines[i];
+        if (in->debounce_us)
+            len += sysfs_emit_at(buf, len, "%d %u %s\n", i, in->debounce_us,
+                                 in->hw_debounce ? "hw" : "sw");
+    }
+    mutex_unlock(&debounce_lock);
+    return len;
+}
+
+static ssize_t debounce_store(struct device *d, struct device_attribute *attr,
+                              const char *buf, size_t count)
+{
+    struct gpiodrv_input *in;
+    unsigned int usecs;
+    u32 line;
+
+    if (sscanf(buf, "%u %u", &line, &usecs) != 2)
+        return -EINVAL;
+    if (line >= nr_inputs)
+        return -EINVAL;
+    in = &input_lines[line];
+
+    mutex_lock(&debounce_lock);
+    /* A chip without debounce support (bcm2835, gpio-sim) returns -ENOTSUPP */
+    in->hw_debounce = gpiod_set_debounce(in->desc, usecs) == 0 && usecs;
+    WRITE_ONCE(in->debounce_us, usecs);
+    if (in->hw_debounce || !usecs)
+        flush_delayed_work(&in->debounce_work);
+    in->level = gpiod_get_value_cansleep(in->desc);
+    mutex_unlock(&debounce_lock);
+    return count;
+}
+static DEVICE_ATTR_RW(debounce);
+
+/* /sys/class/new_class/gpio_device/coalesce_us: event coalescing window, 0 = off */
+static ssize_t coalesce_us_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%u\n", READ_ONCE(coalesce_us));
+}
+
+static ssize_t coalesce_us_store(struct device *d, struct device_attribute *attr,
+                                 const char *buf, size_t count)
+{
+    unsigned int usecs;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &usecs);
+    if (ret)
+        return ret;
+    WRITE_ONCE(coalesce_us, usecs);
+    return count;
+}
+static DEVICE_ATTR_RW(coalesce_us);
+
+/*
+ * /sys/class/new_class/gpio_device/capture: "period_ns samples overruns
+ * missed rate_hz" of the running (or last) capture, rate_hz being the
+ * achieved sample rate.
+ */
+static ssize_t capture_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    u64 elapsed, rate = 0;
+    ssize_t len;
+
+    mutex_lock(&capture.lock);
+    elapsed = ktime_to_ns(ktime_sub(capture.period_ns ? ktime_get() : capture.stop,
+                                    capture.start));
+    if (elapsed)
+        rate = div64_u64(capture.taken * NSEC_PER_SEC, elapsed);
+    len = sysfs_emit(buf, "%u %llu %llu %llu %llu\n", capture.period_ns, capture.taken,
+                     capture.overruns, capture.missed, rate);
+    mutex_unlock(&capture.lock);
+    return len;
+}
+static DEVICE_ATTR_RO(capture);
+
+static struct attribute *gpiodrv_attrs[] = {
+    &dev_attr_pwm.attr,
+    &dev_attr_debounce.attr,
+    &dev_attr_coalesce_us.attr,
+    &dev_attr_capture.attr,
+    NULL,
+};
+
+static const struct attribute_group gpiodrv_group = {
+    .attrs = gpiodrv_attrs,
+};
+
+static const struct attribute_group *gpiodrv_groups[] = {
+    &gpiodrv_group,
+    &gpiodrv_stats_group,
+    NULL,
+};
+
+/*
+ * Bind to the platform device: get the lines, then create the device files.
+ * The driver state is global, so only one device is bound at a time.
+ */
+static int gpiodrv_probe(struct platform_device *pdev)
+{
+    struct device *dev = &pdev->dev;
+    int ret;
+    int i;
+
+    if (out_descs)
+        return -EBUSY;
+
+    /* Get the output lines driven low, and the optional inputs */
+    out_descs = devm_gpiod_get_array(dev, "out", GPIOD_OUT_LOW);
+    if (IS_ERR(out_descs))
+    {
+        ret = PTR_ERR(out_descs);
+        out_descs = NULL;
+        return dev_err_probe(dev, ret, "Can not get the output lines \n");
+    }
+    in_descs = devm_gpiod_get_array_optional(dev, "in", GPIOD_IN);
+    if (IS_ERR(in_descs))
+    {
+        ret = PTR_ERR(in_descs);
+        out_descs = NULL;
+        return dev_err_probe(dev, ret, "Can not get the input lines \n");
+    }
+    if (out_descs->ndescs > GPIODRV_MAX_LINES ||
+        (in_descs && in_descs->ndescs > GPIODRV_MAX_LINES))
+    {
+        out_descs = NULL;
+        return -EINVAL;
+    }
+    line_descs = out_descs->desc;
+    nr_lines = out_descs->ndescs;
+    nr_inputs = in_descs ? in_descs->ndescs : 0;
+    in_sleep = false;
+    for (i = 0; i < nr_inputs; i++)
+        in_sleep |= gpiod_cansleep(in_descs->desc[i]);
+    sleep_lines = 0;
+    for (i = 0; i < nr_lines; i++)
+        if (gpiod_cansleep(line_descs[i]))
+            sleep_lines |= BIT(i);
+    out_state = 0;
+    out_dir = gpiodrv_all_lines();
+
+    /* Allocate the statistics before the device becomes visible */
+    gpio_stats = alloc_percpu(struct gpiodrv_stats);
+    if (!gpio_stats)
+    {
+        out_descs = NULL;
+        return -ENOMEM;
+    }
 
 #if DYNAMIC
-    /* Dynamically allocate a major number for the device */
-    major_num = register_chrdev(0, DEVICE_NAME, &fops);
-    if (major_num < 0)
+    /* Dynamically allocate the minor range of the device files */
+    ret = alloc_chrdev_region(&dev_num, 0, NR_MINORS, DEVICE_NAME);
+    if (ret < 0)
     {
         pr_err("failed to register device number dynamically \n");
-        return ret;
+        goto region_fail;
     }
 #else
     /* Static allocation of major and minor numbers */
     dev_num = MKDEV(MAJOR_NUM, MINOR_NUM);
-    ret = register_chrdev_region(dev_num, 1, DEVICE_NAME);
+    ret = register_chrdev_region(dev_num, NR_MINORS, DEVICE_NAME);
     if (ret < 0)
     {
         pr_err("failed to register static device number \n");
-        return ret;
+        goto region_fail;
     }
     pr_info("static allocation Major:%d Minor:%d \n", MAJOR(dev_num), MINOR(dev_num));
 #endif
+    major_num = MAJOR(dev_num);
 
     /* Initialize the cdev structure and add it to the system */
     cdev_init(&new_cdev, &fops);
     new_cdev.owner = THIS_MODULE;
-    ret = cdev_add(&new_cdev, MKDEV(major_num, 0), 1);
+    ret = cdev_add(&new_cdev, MKDEV(major_num, 0), NR_MINORS);
     if (ret < 0)
     {
         pr_err("unable to create cdev add \n");
@@ -76,120 +1123,1044 @@ static int __init gpio_driver_init(void)
     }
 
     /* Create a device class in /sys/class/new_class */
-    dev_class = class_create(THIS_MODULE, "new_class");
+    dev_class = class_create("new_class");
     if (IS_ERR(dev_class))
     {
         pr_err("unable to create the class \n");
+        ret = PTR_ERR(dev_class);
         goto class_fail;
     }
 
-    /* Create device information in /sys/class/new_class/new_device */
-    dev_device = device_create(dev_class, NULL, MKDEV(major_num, 0), NULL, DEVICE_NAME);
+    /* Create device information and statistics in /sys/class/new_class/gpio_device */
+    dev_device = device_create_with_groups(dev_class, dev, MKDEV(major_num, 0), NULL,
+                                           gpiodrv_groups, DEVICE_NAME);
     if (IS_ERR(dev_device))
     {
         pr_err("unable to create the device \n");
+        ret = PTR_ERR(dev_device);
         goto device_fail;
     }
 
-    /* Allocate memory for the device buffer */
-    if ((local_buffer = kmalloc(mem_size, GFP_KERNEL)) == 0)
+    /* Create /dev/gpio_events and start capturing edges on the inputs */
+    events_device = device_create(dev_class, dev, MKDEV(major_num, EVENTS_MINOR), NULL,
+                                  EVENTS_NAME);
+    if (IS_ERR(events_device))
     {
-        pr_err("cannot allocate memory \n");
-        goto device_fail;
+        pr_err("unable to create the event device \n");
+        ret = PTR_ERR(events_device);
+        goto events_fail;
     }
+    ret = gpiodrv_request_inputs();
+    if (ret)
+        goto inputs_fail;
 
-    /* Request the GPIO pin */
-    if (gpio_request((GPIO21 + GPIO_OFFSET), "rpi-gpio-21"))
+    /* Create /dev/gpio_capture with its ring when there are lines to sample */
+    if (nr_inputs)
     {
-        pr_err("Can not request gpio 21 \n");
-        goto device_fail;
+        ret = gpiodrv_capture_alloc();
+        if (ret)
+            goto alloc_fail;
     }
-
-    /* Set GPIO direction to output */
-    if (gpio_direction_output((GPIO21 + GPIO_OFFSET), 0))
+    capture_device = device_create(dev_class, dev, MKDEV(major_num, CAPTURE_MINOR), NULL,
+                                   CAPTURE_NAME);
+    if (IS_ERR(capture_device))
     {
-        pr_err("Can not set the gpio 21 as output \n");
-        goto gpio_fail;
+        pr_err("unable to create the capture device \n");
+        ret = PTR_ERR(capture_device);
+        goto capture_fail;
+    }
+    async_device = device_create(dev_class, dev, MKDEV(major_num, ASYNC_MINOR), NULL,
+                                 ASYNC_NAME);
+    if (IS_ERR(async_device))
+    {
+        pr_err("unable to create the async device \n");
+        ret = PTR_ERR(async_device);
+        goto async_fail;
     }
 
-    printk(KERN_INFO "Kernel Module Inserted Successfully...\n");
+    dev_info(dev, "%d output and %d input lines \n", nr_lines, nr_inputs);
     return 0;
 
-gpio_fail:
-    gpio_free(GPIO21 + GPIO_OFFSET);
+    /* Undo the steps above in reverse order */
+async_fail:
+    device_destroy(dev_class, MKDEV(major_num, CAPTURE_MINOR));
+capture_fail:
+    gpiodrv_capture_free();
+alloc_fail:
+    gpiodrv_free_inputs(nr_inputs);
+inputs_fail:
+    device_destroy(dev_class, MKDEV(major_num, EVENTS_MINOR));
+events_fail:
+    device_destroy(dev_class, MKDEV(major_num, 0));
+    gpiodrv_wave_stop(); // The device's sysfs files may have started them
+    gpiodrv_pwm_stop_all();
 device_fail:
     class_destroy(dev_class);
-cdev_fail:
-    cdev_del(&new_cdev);
 class_fail:
-    unregister_chrdev(major_num, DEVICE_NAME);
-
-    return -1;
+    cdev_del(&new_cdev);
+cdev_fail:
+    unregister_chrdev_region(dev_num, NR_MINORS);
+region_fail:
+    free_percpu(gpio_stats);
+    out_descs = NULL;
+    return ret;
 }
 
 /* File open function */
 static int dev_open(struct inode *inodep, struct file *filep)
 {
-    pr_info("New device file open function called \n");
-    return 0;
+    u64 start = ktime_get_ns();
+    int ret = 0;
+
+    /* /dev/gpio_events shares the major number but has its own operations */
+    if (iminor(inodep) == EVENTS_MINOR)
+    {
+        replace_fops(filep, &event_fops);
+        stream_open(inodep, filep);
+    }
+    else if (iminor(inodep) == CAPTURE_MINOR)
+    {
+        replace_fops(filep, &capture_fops);
+        stream_open(inodep, filep);
+    }
+    else if (iminor(inodep) == ASYNC_MINOR)
+    {
+        replace_fops(filep, &async_fops);
+        ret = async_open(inodep, filep);
+    }
+    gpiodrv_lat_record(GPIODRV_LAT_OPEN, start);
+    trace_gpiodrv_open(ret);
+    return ret;
 }
 
 /* File release function */
 static int dev_release(struct inode *inodep, struct file *filep)
 {
-    pr_info("New device file release function called \n");
+    trace_gpiodrv_release(0);
     return 0;
 }
 
-/* File read function */
+/* File read function, returns the line mask as "0x%x\n" */
 static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
 {
-    pr_info("New device file read function called \n");
-    if (copy_to_user(buffer, local_buffer, mem_size))
+    u64 start = ktime_get_ns();
+    loff_t pos = *offset;
+    char kbuf[16];
+    ssize_t ret;
+    u32 mask;
+
+    this_cpu_inc(gpio_stats->reads);
+    ret = gpiodrv_get_mask(&mask);
+    if (ret == 0)
     {
-        pr_err("Data read error \n");
+        ret = simple_read_from_buffer(buffer, len, offset, kbuf,
+                                      scnprintf(kbuf, sizeof(kbuf), "0x%x\n", mask));
+        if (ret == -EFAULT)
+        {
+            pr_debug("Data read error \n");
+            this_cpu_inc(gpio_stats->faults);
+        }
     }
-    pr_info("Data read successfully...\n");
-    return mem_size;
+    gpiodrv_lat_record(GPIODRV_LAT_READ, start);
+    trace_gpiodrv_read(len, pos, ret);
+    return ret;
 }
 
-/* File write function */
+/*
+ * File write function. The data is a line mask as text, decimal or 0x hex,
+ * bit i drives output line i; all lines change together. "0" and "1" keep their
+ * old meaning for a single line.
+ */
 static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset)
 {
-    char value;
-    pr_info("New device file write function called \n");
-    if (copy_from_user(local_buffer, buffer, len))
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+    u32 mask;
+
+    this_cpu_inc(gpio_stats->writes);
+    this_cpu_add(gpio_stats->bytes_written, len);
+    ret = kstrtou32_from_user(buffer, len, 0, &mask);
+    if (ret == 0 && nr_lines < GPIODRV_MAX_LINES && (mask >> nr_lines))
+        ret = -EINVAL;
+    if (ret == -EFAULT)
+    {
+        pr_debug("Data write error \n");
+        this_cpu_inc(gpio_stats->faults);
+    }
+    else if (ret)
+    {
+        pr_debug("The given value is invalid\n");
+        this_cpu_inc(gpio_stats->invalid);
+    }
+    else
+    {
+        ret = gpiodrv_set_mask(mask);
+        if (ret == 0)
+            ret = len;
+    }
+    gpiodrv_lat_record(GPIODRV_LAT_WRITE, start);
+    trace_gpiodrv_write(len, *offset, ret);
+    return ret;
+}
+
+/*
+ * Read queued edge events, as many whole struct gpiodrv_event as fit in
+ * buffer. Blocks while the queue is empty unless O_NONBLOCK.
+ */
+static ssize_t events_read(struct file *filep, char __user *buffer, size_t len, loff_t *offset)
+{
+    unsigned int copied;
+    int ret;
+
+    if (len < sizeof(struct gpiodrv_event))
+        return -EINVAL;
+    this_cpu_inc(gpio_stats->reads);
+    do
+    {
+        if (kfifo_is_empty(&event_fifo))
+        {
+            if (filep->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+            ret = wait_event_interruptible(event_wq, !kfifo_is_empty(&event_fifo));
+            if (ret)
+                return ret;
+        }
+        if (mutex_lock_interruptible(&event_read_lock))
+            return -ERESTARTSYS;
+        ret = kfifo_to_user(&event_fifo, buffer,
+                            rounddown(len, sizeof(struct gpiodrv_event)), &copied);
+        mutex_unlock(&event_read_lock);
+        if (ret)
+        {
+            pr_debug("Event read error \n");
+            this_cpu_inc(gpio_stats->faults);
+            return ret;
+        }
+    } while (!copied); // Another reader took the events first
+
+    trace_gpiodrv_read(len, *offset, copied);
+    return copied;
+}
+
+static __poll_t events_poll(struct file *filep, poll_table *wait)
+{
+    poll_wait(filep, &event_wq, wait);
+    return kfifo_is_empty(&event_fifo) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+/*
+ * Drive one waveform sample from the timer. The lines were checked to be
+ * non-sleeping outputs when the waveform was queued. Called with wave.lock.
+ */
+static void gpiodrv_wave_apply(const struct gpiodrv_sample *s)
+{
+    struct gpio_desc *descs[GPIODRV_MAX_LINES];
+    unsigned long bits = 0;
+    unsigned int n = 0;
+    int i;
+
+    for (i = 0; i < nr_lines; i++)
+    {
+        if (!(s->mask & BIT(i)))
+            continue;
+        if (s->value & BIT(i))
+            __set_bit(n, &bits);
+        descs[n++] = line_descs[i];
+    }
+    if (n)
+        gpiod_set_array_value(n, descs, NULL, &bits);
+    out_state = (out_state & ~s->mask) | (s->value & s->mask);
+}
+
+/*
+ * Waveform timer. Plays samples until the next one is due in WAVE_SPIN_NS
+ * or more, then rearms for it. Shorter delays are busy waited here, with
+ * interrupts off, for at most WAVE_SPIN_MAX_NS per callback: rearming costs
+ * more than such a delay and would add its own jitter. After a busy wait
+ * the next callback comes no sooner than WAVE_TICK_NS after this one
+ * started, as in the capture timer, so a waveform of short delays pauses
+ * there instead of keeping a single core Pi in hard IRQ context. Every due
+ * time is derived from the previous one (or from the end of such a pause),
+ * so callback lateness does not accumulate.
+ */
+static enum hrtimer_restart gpiodrv_wave_timer(struct hrtimer *timer)
+{
+    enum hrtimer_restart restart = HRTIMER_NORESTART;
+    ktime_t next = hrtimer_get_expires(timer);
+    ktime_t start = ktime_get();
+    ktime_t now = start;
+    ktime_t spin_end = ktime_add_ns(start, WAVE_SPIN_MAX_NS);
+    const struct gpiodrv_sample *s;
+    struct gpiodrv_wave_slot *slot;
+    bool wake = false;
+
+    gpiodrv_hist_add(GPIODRV_LAT_WAVE, ktime_after(now, next) ? ktime_to_ns(ktime_sub(now, next)) : 0);
+
+    raw_spin_lock(&wave.lock);
+    for (;;)
+    {
+        slot = &wave.slot[wave.play];
+        s = &slot->samples[wave.pos++];
+        gpiodrv_wave_apply(s);
+        next = ktime_add_ns(next, s->delay_ns);
+
+        if (wave.pos == slot->count)
+        {
+            /* Finished, go straight on with the other slot if it is queued */
+            slot->state = WAVE_DONE;
+            wave.completed = slot->seq;
+            wake = true;
+            wave.play ^= 1;
+            wave.pos = 0;
+            if (wave.slot[wave.play].state != WAVE_READY)
+            {
+                wave.play ^= 1;
+                wave.running = false;
+                break;
+            }
+        }
+
+        now = ktime_get();
+        if (s->delay_ns >= WAVE_SPIN_NS || !ktime_before(next, spin_end) ||
+            !ktime_before(now, spin_end))
+        {
+            if (s->delay_ns < WAVE_SPIN_NS && ktime_before(next, ktime_add_ns(start, WAVE_TICK_NS)))
+                next = ktime_add_ns(start, WAVE_TICK_NS); // Spin budget used, pause
+            hrtimer_set_expires(timer, ktime_before(next, now) ? now : next);
+            restart = HRTIMER_RESTART;
+            break;
+        }
+        while (ktime_before(ktime_get(), next))
+            cpu_relax();
+    }
+    raw_spin_unlock(&wave.lock);
+
+    if (wake)
+        wake_up_interruptible(&wave.wq);
+    return restart;
+}
+
+/* Free the samples of played slots */
+static void gpiodrv_wave_reap(void)
+{
+    struct gpiodrv_sample *done[2];
+    int i;
+
+    raw_spin_lock_irq(&wave.lock);
+    for (i = 0; i < 2; i++)
+    {
+        done[i] = NULL;
+        if (wave.slot[i].state == WAVE_DONE)
+        {
+            done[i] = wave.slot[i].samples;
+            wave.slot[i].samples = NULL;
+            wave.slot[i].state = WAVE_EMPTY;
+        }
+    }
+    raw_spin_unlock_irq(&wave.lock);
+    kvfree(done[0]);
+    kvfree(done[1]);
+}
+
+/* Index of a free slot, or -1; the slot after the playing one comes first */
+static int gpiodrv_wave_free_slot(void)
+{
+    unsigned int next = wave.running ? wave.play ^ 1 : wave.play;
+
+    gpiodrv_wave_reap();
+    if (wave.slot[next].state == WAVE_EMPTY)
+        return next;
+    if (!wave.running && wave.slot[next ^ 1].state == WAVE_EMPTY)
+        return next ^ 1;
+    return -1;
+}
+
+/* Lines a waveform may drive: non-sleeping outputs without PWM */
+static u32 gpiodrv_wave_lines(void)
+{
+    u32 lines = 0;
+    int i;
+
+    mutex_lock(&out_lock);
+    mutex_lock(&pwm_lock);
+    for (i = 0; i < nr_lines; i++)
+        if ((out_dir & BIT(i)) && !pwm_lines[i].period_ns && !(sleep_lines & BIT(i)))
+            lines |= BIT(i);
+    mutex_unlock(&pwm_lock);
+    mutex_unlock(&out_lock);
+    return lines;
+}
+
+/* Queue a waveform behind the one playing, start playback if idle */
+static int gpiodrv_wave_queue(struct file *filep, struct gpiodrv_wave *w)
+{
+    struct gpiodrv_sample *samples;
+    struct gpiodrv_wave_slot *slot;
+    u32 lines;
+    int idx;
+    u32 i;
+
+    if (!w->count || w->count > GPIODRV_WAVE_MAX)
+        return -EINVAL;
+    samples = vmemdup_user(u64_to_user_ptr(w->samples), w->count * sizeof(*samples));
+    if (IS_ERR(samples))
+        return PTR_ERR(samples);
+    lines = gpiodrv_wave_lines();
+    for (i = 0; i < w->count; i++)
+    {
+        if (samples[i].mask & ~lines)
+        {
+            kvfree(samples);
+            return -EINVAL;
+        }
+    }
+
+    /* Wait for a free slot; the free check reaps, so it runs in process context */
+    for (;;)
+    {
+        mutex_lock(&wave.queue_lock);
+        idx = gpiodrv_wave_free_slot();
+        if (idx >= 0)
+            break;
+        mutex_unlock(&wave.queue_lock);
+        if (filep->f_flags & O_NONBLOCK)
+        {
+            kvfree(samples);
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(wave.wq, !wave.running ||
+                                     wave.slot[wave.play ^ 1].state != WAVE_READY))
+        {
+            kvfree(samples);
+            return -ERESTARTSYS;
+        }
+    }
+
+    raw_spin_lock_irq(&wave.lock);
+    slot = &wave.slot[idx];
+    slot->samples = samples;
+    slot->count = w->count;
+    slot->seq = ++wave.submitted;
+    slot->state = WAVE_READY;
+    w->seq = slot->seq;
+    if (!wave.running)
+    {
+        wave.play = idx;
+        wave.pos = 0;
+        wave.running = true;
+        hrtimer_start(&wave.timer, ktime_get(), HRTIMER_MODE_ABS_HARD);
+    }
+    raw_spin_unlock_irq(&wave.lock);
+    mutex_unlock(&wave.queue_lock);
+    return 0;
+}
+
+/* Stop playback and drop both slots */
+static void gpiodrv_wave_stop(void)
+{
+    int i;
+
+    mutex_lock(&wave.queue_lock);
+    hrtimer_cancel(&wave.timer);
+    raw_spin_lock_irq(&wave.lock);
+    wave.running = false;
+    for (i = 0; i < 2; i++)
+        if (wave.slot[i].state == WAVE_READY)
+            wave.slot[i].state = WAVE_DONE;
+    wave.completed = wave.submitted;
+    raw_spin_unlock_irq(&wave.lock);
+    mutex_unlock(&wave.queue_lock);
+    gpiodrv_wave_reap();
+    wake_up_interruptible(&wave.wq);
+}
+
+/*
+ * Number of unread samples. A consumer on the mapping writes tail, so never
+ * trust the distance to head beyond the ring size.
+ */
+static u32 gpiodrv_capture_used(u32 head, u32 tail)
+{
+    return min_t(u32, head - tail, capture.size);
+}
+
+/*
+ * Read captured samples, as many whole struct gpiodrv_capture_sample as fit
+ * in buffer. Blocks while the ring is empty and sampling runs, unless
+ * O_NONBLOCK; returns 0 once sampling stopped and the ring is drained.
+ */
+static ssize_t capture_read(struct file *filep, char __user *buffer, size_t len, loff_t *offset)
+{
+    const size_t size = sizeof(struct gpiodrv_capture_sample);
+    u32 head, tail, n, first;
+    ssize_t ret;
+
+    if (!capture.area)
+        return -ENODEV;
+    if (len < size)
+        return -EINVAL;
+    if (mutex_lock_interruptible(&capture.lock))
+        return -ERESTARTSYS;
+    for (;;)
+    {
+        head = smp_load_acquire(&capture.ctrl->head);
+        tail = READ_ONCE(capture.ctrl->tail);
+        if (head != tail || !capture.period_ns)
+            break;
+        mutex_unlock(&capture.lock);
+        if (filep->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        ret = wait_event_interruptible(capture.wq,
+                                       smp_load_acquire(&capture.ctrl->head) != tail ||
+                                       !READ_ONCE(capture.period_ns));
+        if (ret)
+            return ret;
+        if (mutex_lock_interruptible(&capture.lock))
+            return -ERESTARTSYS;
+    }
+
+    n = min_t(u32, gpiodrv_capture_used(head, tail), len / size);
+    first = min_t(u32, n, capture.size - (tail & (capture.size - 1)));
+    ret = n * size;
+    if (copy_to_user(buffer, &capture.samples[tail & (capture.size - 1)], first * size) ||
+        copy_to_user(buffer + first * size, capture.samples, (n - first) * size))
+    {
+        this_cpu_inc(gpio_stats->faults);
+        ret = -EFAULT;
+    }
+    else
+        smp_store_release(&capture.ctrl->tail, tail + n);
+    mutex_unlock(&capture.lock);
+    trace_gpiodrv_read(len, *offset, ret);
+    return ret;
+}
+
+static __poll_t capture_poll(struct file *filep, poll_table *wait)
+{
+    if (!capture.area)
+        return EPOLLERR;
+    poll_wait(filep, &capture.wq, wait);
+    if (smp_load_acquire(&capture.ctrl->head) != READ_ONCE(capture.ctrl->tail) ||
+        !READ_ONCE(capture.period_ns))
+        return EPOLLIN | EPOLLRDNORM;
+    return 0;
+}
+
+/* Map the control page and the samples; the consumer writes tail through it */
+static int capture_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+    if (!capture.area)
+        return -ENODEV;
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+    return remap_vmalloc_range(vma, capture.area, vma->vm_pgoff);
+}
+
+static long capture_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+    u32 period_ns;
+    long ret;
+
+    switch (cmd)
     {
-        pr_err("Data write error \n");
+        case GPIODRV_IOC_CAPTURE_START:
+            if (get_user(period_ns, (u32 __user *)arg))
+                return -EFAULT;
+            mutex_lock(&capture.lock);
+            ret = gpiodrv_capture_start(period_ns);
+            mutex_unlock(&capture.lock);
+            return ret;
+        case GPIODRV_IOC_CAPTURE_STOP:
+            mutex_lock(&capture.lock);
+            gpiodrv_capture_stop();
+            mutex_unlock(&capture.lock);
+            return 0;
+        default:
+            return -ENOTTY;
     }
-    value = (char)*local_buffer;
-    pr_info("Data written successfully...local_buffer:%c\n", value);
-    switch (value)
+}
+
+static bool gpiodrv_async_is_write(u32 op)
+{
+    return op == GPIODRV_OP_SET || op == GPIODRV_OP_CLEAR || op == GPIODRV_OP_TOGGLE;
+}
+
+/*
+ * Apply queued commands in order. A run of set/clear/toggle commands on
+ * disjoint lines becomes a single gpiodrv_apply, which writes each chip
+ * once; a GET, an invalid command or an overlapping mask ends the run.
+ * Stops while the completion queue is full; async_read requeues the work.
+ */
+static void gpiodrv_async_work(struct work_struct *work)
+{
+    struct gpiodrv_async *a = container_of(work, struct gpiodrv_async, work);
+    struct gpiodrv_async_cmd cmds[ASYNC_MERGE_MAX];
+    struct gpiodrv_async_done done;
+    unsigned int n, i;
+    u32 which, values;
+    int ret;
+
+    while (kfifo_peek(&a->cmds, &cmds[0]))
     {
-        case '0':
-            gpio_set_value((GPIO21 + GPIO_OFFSET), 0);
+        n = 1;
+        if (gpiodrv_async_is_write(cmds[0].op) && !(cmds[0].mask & ~gpiodrv_all_lines()))
+        {
+            /* Collect the run of commands that can share one update */
+            which = cmds[0].mask;
+            while (n < min_t(unsigned int, ASYNC_MERGE_MAX, kfifo_avail(&a->done)) &&
+                   kfifo_out_peek(&a->cmds, cmds, n + 1) == n + 1 &&
+                   gpiodrv_async_is_write(cmds[n].op) &&
+                   !(cmds[n].mask & (which | ~gpiodrv_all_lines())))
+                which |= cmds[n++].mask;
+            if (kfifo_avail(&a->done) < n)
+                break;
+
+            mutex_lock(&out_lock);
+            values = out_state;
+            for (i = 0; i < n; i++)
+            {
+                if (cmds[i].op == GPIODRV_OP_SET)
+                    values |= cmds[i].mask;
+                else if (cmds[i].op == GPIODRV_OP_CLEAR)
+                    values &= ~cmds[i].mask;
+                else
+                    values ^= cmds[i].mask;
+            }
+            ret = gpiodrv_apply(which, values);
+            mutex_unlock(&out_lock);
+            this_cpu_add(gpio_stats->async_merged, n - 1);
+            done.value = 0;
+        }
+        else
+        {
+            if (kfifo_is_full(&a->done))
+                break;
+            done.value = cmds[0].mask;
+            ret = gpiodrv_op(cmds[0].op, &done.value);
+            if (cmds[0].op != GPIODRV_OP_GET)
+                done.value = 0;
+        }
+
+        for (i = 0; i < n; i++)
+        {
+            done.tag = cmds[i].tag;
+            done.result = ret;
+            kfifo_put(&a->done, done);
+        }
+        for (i = 0; i < n; i++)
+            kfifo_skip(&a->cmds);
+        this_cpu_add(gpio_stats->async_cmds, n);
+        wake_up_interruptible_poll(&a->wq, EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM);
+    }
+}
+
+static int async_open(struct inode *inodep, struct file *filep)
+{
+    struct gpiodrv_async *a;
+
+    a = kzalloc(sizeof(*a), GFP_KERNEL);
+    if (!a)
+        return -ENOMEM;
+    INIT_KFIFO(a->cmds);
+    INIT_KFIFO(a->done);
+    mutex_init(&a->write_lock);
+    mutex_init(&a->read_lock);
+    INIT_WORK(&a->work, gpiodrv_async_work);
+    init_waitqueue_head(&a->wq);
+    filep->private_data = a;
+    return stream_open(inodep, filep);
+}
+
+/* A running worker finishes before the queues go away */
+static int async_release(struct inode *inodep, struct file *filep)
+{
+    struct gpiodrv_async *a = filep->private_data;
+
+    cancel_work_sync(&a->work);
+    kfree(a);
+    return dev_release(inodep, filep);
+}
+
+/* Queue whole commands; blocks only while the queue is full */
+static ssize_t async_write(struct file *filep, const char __user *buffer, size_t len,
+                           loff_t *offset)
+{
+    struct gpiodrv_async *a = filep->private_data;
+    unsigned int copied;
+    int ret;
+
+    if (len < sizeof(struct gpiodrv_async_cmd))
+        return -EINVAL;
+    this_cpu_inc(gpio_stats->writes);
+    if (mutex_lock_interruptible(&a->write_lock))
+        return -ERESTARTSYS;
+    while (kfifo_is_full(&a->cmds))
+    {
+        mutex_unlock(&a->write_lock);
+        if (filep->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        ret = wait_event_interruptible(a->wq, !kfifo_is_full(&a->cmds));
+        if (ret)
+            return ret;
+        if (mutex_lock_interruptible(&a->write_lock))
+            return -ERESTARTSYS;
+    }
+    ret = kfifo_from_user(&a->cmds, buffer,
+                          rounddown(len, sizeof(struct gpiodrv_async_cmd)), &copied);
+    mutex_unlock(&a->write_lock);
+    if (copied)
+        queue_work(async_wq, &a->work);
+    trace_gpiodrv_write(len, *offset, ret ? ret : copied);
+    if (ret)
+        this_cpu_inc(gpio_stats->faults);
+    return copied ? copied : ret;
+}
+
+/* Read whole completions; blocks while there are none unless O_NONBLOCK */
+static ssize_t async_read(struct file *filep, char __user *buffer, size_t len, loff_t *offset)
+{
+    struct gpiodrv_async *a = filep->private_data;
+    unsigned int copied;
+    int ret;
+
+    if (len < sizeof(struct gpiodrv_async_done))
+        return -EINVAL;
+    this_cpu_inc(gpio_stats->reads);
+    do
+    {
+        if (kfifo_is_empty(&a->done))
+        {
+            if (filep->f_flags & O_NONBLOCK)
+                return -EAGAIN;
+            ret = wait_event_interruptible(a->wq, !kfifo_is_empty(&a->done));
+            if (ret)
+                return ret;
+        }
+        if (mutex_lock_interruptible(&a->read_lock))
+            return -ERESTARTSYS;
+        ret = kfifo_to_user(&a->done, buffer,
+                            rounddown(len, sizeof(struct gpiodrv_async_done)), &copied);
+        mutex_unlock(&a->read_lock);
+        if (ret)
+        {
+            this_cpu_inc(gpio_stats->faults);
+            return ret;
+        }
+    } while (!copied); // Another reader took the completions first
+
+    /* The worker may have stopped on a full completion queue */
+    if (!kfifo_is_empty(&a->cmds))
+        queue_work(async_wq, &a->work);
+    trace_gpiodrv_read(len, *offset, copied);
+    return copied;
+}
+
+static __poll_t async_poll(struct file *filep, poll_table *wait)
+{
+    struct gpiodrv_async *a = filep->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(filep, &a->wq, wait);
+    if (!kfifo_is_empty(&a->done))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (!kfifo_is_full(&a->cmds))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
+
+/* Apply one operation; for GPIODRV_OP_GET the line levels go to *mask */
+static int gpiodrv_op(u32 op, u32 *mask)
+{
+    int ret;
+
+    if (op != GPIODRV_OP_GET && (*mask & ~gpiodrv_all_lines()))
+        return -EINVAL;
+    this_cpu_inc(gpio_stats->ops);
+    mutex_lock(&out_lock);
+    switch (op)
+    {
+        case GPIODRV_OP_SET:
+            ret = gpiodrv_apply(*mask, out_state | *mask);
+            break;
+        case GPIODRV_OP_CLEAR:
+            ret = gpiodrv_apply(*mask, out_state & ~*mask);
+            break;
+        case GPIODRV_OP_TOGGLE:
+            ret = gpiodrv_apply(*mask, out_state ^ *mask);
             break;
-        case '1':
-            gpio_set_value((GPIO21 + GPIO_OFFSET), 1);
+        case GPIODRV_OP_GET:
+            ret = gpiodrv_get_mask(mask);
             break;
         default:
-            pr_info("The given value is invalid\n");
+            ret = -EINVAL;
             break;
     }
-    return len;
+    mutex_unlock(&out_lock);
+    return ret;
 }
 
-/* Exit function to clean up resources */
-static void __exit gpio_driver_exit(void)
+/* Switch the lines in dir->mask to input or output, outputs keep out_state */
+static int gpiodrv_set_dir(const struct gpiodrv_dir *dir)
+{
+    int ret = 0;
+    int i;
+
+    if (dir->mask & ~gpiodrv_all_lines())
+        return -EINVAL;
+    mutex_lock(&out_lock);
+    mutex_lock(&pwm_lock);
+    for (i = 0; i < nr_lines && !ret; i++)
+    {
+        if (!(dir->mask & BIT(i)))
+            continue;
+        if (dir->output & BIT(i))
+        {
+            ret = gpiod_direction_output(line_descs[i], !!(out_state & BIT(i)));
+            if (ret == 0)
+                out_dir |= BIT(i);
+        }
+        else if (pwm_lines[i].period_ns)
+            ret = -EBUSY; // Stop PWM first
+        else
+        {
+            ret = gpiod_direction_input(line_descs[i]);
+            if (ret == 0)
+                out_dir &= ~BIT(i);
+        }
+    }
+    mutex_unlock(&pwm_lock);
+    mutex_unlock(&out_lock);
+    return ret;
+}
+
+/* Run a batch, BATCH_CHUNK operations copied in and out at a time */
+static int gpiodrv_batch(struct gpiodrv_batch *batch)
+{
+    struct gpiodrv_op __user *uops = u64_to_user_ptr(batch->ops);
+    struct gpiodrv_op ops[BATCH_CHUNK];
+    unsigned int n, i;
+    bool got;
+    int ret = 0;
+
+    if (batch->count > GPIODRV_BATCH_MAX)
+        return -EINVAL;
+    batch->done = 0;
+    while (batch->done < batch->count && !ret)
+    {
+        n = min_t(unsigned int, batch->count - batch->done, BATCH_CHUNK);
+        if (copy_from_user(ops, uops + batch->done, n * sizeof(ops[0])))
+            return -EFAULT;
+        got = false;
+        for (i = 0; i < n && !ret; i++)
+        {
+            ret = gpiodrv_op(ops[i].op, &ops[i].mask);
+            got |= ops[i].op == GPIODRV_OP_GET;
+        }
+        if (ret)
+            i--;
+        if (got && copy_to_user(uops + batch->done, ops, i * sizeof(ops[0])))
+            return -EFAULT;
+        batch->done += i;
+    }
+    return ret;
+}
+
+/* Binary command interface, see gpiodrv.h */
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
 {
-    gpio_set_value((GPIO21 + GPIO_OFFSET), 0);
-    gpio_free(GPIO21 + GPIO_OFFSET);
+    void __user *argp = (void __user *)arg;
+    struct gpiodrv_batch batch;
+    struct gpiodrv_dir dir;
+    long ret;
+    u32 mask;
+
+    this_cpu_inc(gpio_stats->ioctls);
+    switch (cmd)
+    {
+        case GPIODRV_IOC_SET:
+        case GPIODRV_IOC_CLEAR:
+        case GPIODRV_IOC_TOGGLE:
+            if (get_user(mask, (u32 __user *)argp))
+                return -EFAULT;
+            return gpiodrv_op(cmd == GPIODRV_IOC_SET ? GPIODRV_OP_SET :
+                              cmd == GPIODRV_IOC_CLEAR ? GPIODRV_OP_CLEAR :
+                              GPIODRV_OP_TOGGLE, &mask);
+        case GPIODRV_IOC_GET:
+            ret = gpiodrv_op(GPIODRV_OP_GET, &mask);
+            if (ret == 0 && put_user(mask, (u32 __user *)argp))
+                ret = -EFAULT;
+            return ret;
+        case GPIODRV_IOC_SET_DIR:
+            if (copy_from_user(&dir, argp, sizeof(dir)))
+                return -EFAULT;
+            return gpiodrv_set_dir(&dir);
+        case GPIODRV_IOC_WAVE_QUEUE:
+        {
+            struct gpiodrv_wave w;
+
+            if (copy_from_user(&w, argp, sizeof(w)))
+                return -EFAULT;
+            ret = gpiodrv_wave_queue(filep, &w);
+            if (ret == 0 && put_user(w.seq, &((struct gpiodrv_wave __user *)argp)->seq))
+                ret = -EFAULT;
+            return ret;
+        }
+        case GPIODRV_IOC_WAVE_WAIT:
+            if (get_user(mask, (u32 __user *)argp))
+                return -EFAULT;
+            if ((s32)(mask - READ_ONCE(wave.submitted)) > 0)
+                return -EINVAL;
+            ret = wait_event_interruptible(wave.wq, (s32)(READ_ONCE(wave.completed) - mask) >= 0);
+            gpiodrv_wave_reap();
+            return ret;
+        case GPIODRV_IOC_WAVE_STOP:
+            gpiodrv_wave_stop();
+            return 0;
+        case GPIODRV_IOC_BATCH:
+            if (copy_from_user(&batch, argp, sizeof(batch)))
+                return -EFAULT;
+            ret = gpiodrv_batch(&batch);
+            if (put_user(batch.done, &((struct gpiodrv_batch __user *)argp)->done))
+                ret = -EFAULT;
+            return ret;
+        default:
+            return -ENOTTY;
+    }
+}
+
+/* Unbind: remove the device files and stop everything driving the lines */
+static int gpiodrv_remove(struct platform_device *pdev)
+{
+    device_destroy(dev_class, MKDEV(major_num, ASYNC_MINOR));
+    device_destroy(dev_class, MKDEV(major_num, CAPTURE_MINOR));
+    gpiodrv_capture_free();
+    gpiodrv_free_inputs(nr_inputs);
+    device_destroy(dev_class, MKDEV(major_num, EVENTS_MINOR));
     device_destroy(dev_class, MKDEV(major_num, 0));
-    class_unregister(dev_class);
+    gpiodrv_wave_stop();
+    gpiodrv_pwm_stop_all();
+    gpiodrv_set_mask(0);
     class_destroy(dev_class);
     cdev_del(&new_cdev);
-    unregister_chrdev(major_num, DEVICE_NAME);
-    printk(KERN_INFO "Module Removed Successfully...\n");
+    unregister_chrdev_region(dev_num, NR_MINORS);
+    free_percpu(gpio_stats);
+    out_descs = NULL; // The lines are released by devm after this
+    return 0;
+}
+
+static const struct of_device_id gpiodrv_of_match[] = {
+    { .compatible = "rpi,gpiodrv" },
+    { }
+};
+MODULE_DEVICE_TABLE(of, gpiodrv_of_match);
+
+static struct platform_driver gpiodrv_driver = {
+    .probe = gpiodrv_probe,
+    .remove = gpiodrv_remove,
+    .driver = {
+        .name = DRIVER_NAME,
+        .of_match_table = gpiodrv_of_match,
+        /* Open files use the global state; only module unload may remove it */
+        .suppress_bind_attrs = true,
+    },
+};
+
+static struct gpiod_lookup_table *gpiodrv_lookup; // Lines of gpiodrv_pdev
+static struct platform_device *gpiodrv_pdev; // Device registered for chip
+
+/*
+ * Describe the lines given as module parameters in a gpiod lookup table
+ * and register a platform device for them, for systems without a device
+ * tree node (or to bind to gpio-sim).
+ */
+static int gpiodrv_register_device(void)
+{
+    struct gpiod_lookup *entry;
+    int i;
+
+    if (nr_gpios < 1)
+        return -EINVAL;
+    gpiodrv_lookup = kzalloc(struct_size(gpiodrv_lookup, table, nr_gpios + nr_input_params + 1),
+                             GFP_KERNEL);
+    if (!gpiodrv_lookup)
+        return -ENOMEM;
+    gpiodrv_lookup->dev_id = DRIVER_NAME;
+    entry = gpiodrv_lookup->table;
+    for (i = 0; i < nr_gpios; i++)
+        *entry++ = (struct gpiod_lookup)GPIO_LOOKUP_IDX(chip, gpios[i], "out", i, GPIO_ACTIVE_HIGH);
+    for (i = 0; i < nr_input_params; i++)
+        *entry++ = (struct gpiod_lookup)GPIO_LOOKUP_IDX(chip, inputs[i], "in", i, GPIO_ACTIVE_HIGH);
+    gpiod_add_lookup_table(gpiodrv_lookup);
+
+    gpiodrv_pdev = platform_device_register_simple(DRIVER_NAME, PLATFORM_DEVID_NONE, NULL, 0);
+    if (IS_ERR(gpiodrv_pdev))
+    {
+        gpiod_remove_lookup_table(gpiodrv_lookup);
+        kfree(gpiodrv_lookup);
+        return PTR_ERR(gpiodrv_pdev);
+    }
+    return 0;
+}
+
+/* Initialize the driver */
+static int __init gpio_driver_init(void)
+{
+    int ret;
+    int i;
+
+    raw_spin_lock_init(&wave.lock);
+    init_waitqueue_head(&wave.wq);
+    mutex_init(&wave.queue_lock);
+    hrtimer_init(&wave.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+    wave.timer.function = gpiodrv_wave_timer;
+    hrtimer_init(&capture.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+    capture.timer.function = gpiodrv_capture_timer;
+    mutex_init(&capture.lock);
+    init_waitqueue_head(&capture.wq);
+    hrtimer_init(&coalesce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+    coalesce_timer.function = gpiodrv_coalesce_timer;
+    for (i = 0; i < GPIODRV_MAX_LINES; i++)
+    {
+        hrtimer_init(&pwm_lines[i].timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+        pwm_lines[i].timer.function = gpiodrv_pwm_timer;
+        pwm_lines[i].line = i;
+        INIT_DELAYED_WORK(&input_lines[i].debounce_work, gpiodrv_debounce_work);
+    }
+
+    /* Unbound so one file's commands to a slow expander do not hold up another's */
+    async_wq = alloc_workqueue("gpiodrv_async", WQ_UNBOUND | WQ_HIGHPRI, 0);
+    if (!async_wq)
+        return -ENOMEM;
+    ret = platform_driver_register(&gpiodrv_driver);
+    if (ret)
+    {
+        destroy_workqueue(async_wq);
+        return ret;
+    }
+    if (chip && *chip)
+    {
+        ret = gpiodrv_register_device();
+        if (ret)
+        {
+            pr_err("Can not register the %s lines \n", chip);
+            platform_driver_unregister(&gpiodrv_driver);
+            destroy_workqueue(async_wq);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Exit function to clean up resources */
+static void __exit gpio_driver_exit(void)
+{
+    if (gpiodrv_pdev)
+    {
+        platform_device_unregister(gpiodrv_pdev);
+        gpiod_remove_lookup_table(gpiodrv_lookup);
+        kfree(gpiodrv_lookup);
+    }
+    platform_driver_unregister(&gpiodrv_driver);
+    destroy_workqueue(async_wq);
 }
 
 /* Register init and exit functions */
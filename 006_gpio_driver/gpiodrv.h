@@ -0,0 +1,160 @@
+/*
+ * Definitions shared between the gpiodrv kernel module and user space
+ * applications. Include this from both sides so the layouts always match.
+ */
+#ifndef GPIODRV_H
+#define GPIODRV_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * One edge on an input line, as returned by read() on /dev/gpio_events.
+ * A read returns as many whole events as fit in the buffer; it blocks until
+ * at least one is queued unless the file is O_NONBLOCK.
+ */
+struct gpiodrv_event {
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC time taken in the interrupt handler */
+	__u32 line;		/* index into the inputs module parameter */
+	__u32 edge;		/* GPIODRV_EDGE_RISING or GPIODRV_EDGE_FALLING */
+};
+
+#define GPIODRV_EDGE_RISING 1
+#define GPIODRV_EDGE_FALLING 2
+
+/*
+ * Binary commands on /dev/gpio_device. A line mask has bit i set for the
+ * line gpios[i] of the module parameter. Set, clear and toggle only touch
+ * the lines in the mask that are outputs; the others keep their level.
+ */
+struct gpiodrv_dir {
+	__u32 mask;		/* lines to configure */
+	__u32 output;		/* 1 bits become outputs, 0 bits inputs */
+};
+
+/* One operation of a batch */
+enum gpiodrv_op_code {
+	GPIODRV_OP_SET = 0,	/* drive the lines in mask high */
+	GPIODRV_OP_CLEAR = 1,	/* drive the lines in mask low */
+	GPIODRV_OP_TOGGLE = 2,	/* invert the lines in mask */
+	GPIODRV_OP_GET = 3,	/* mask is replaced with the level of every line */
+};
+
+struct gpiodrv_op {
+	__u32 op;		/* enum gpiodrv_op_code */
+	__u32 mask;
+};
+
+/*
+ * Apply count operations from ops in order in one call. The call stops at
+ * the first failing operation; done tells how many were applied. The results
+ * of GPIODRV_OP_GET are written back into the array.
+ */
+struct gpiodrv_batch {
+	__u64 ops;		/* user pointer to struct gpiodrv_op[count] */
+	__u32 count;
+	__u32 done;		/* out: operations applied */
+};
+
+#define GPIODRV_BATCH_MAX 4096
+
+/*
+ * Waveform playback. A waveform is an array of samples replayed from a
+ * timer: each sample drives the lines in mask to their bits in value, then
+ * waits delay_ns before the next sample. Lines must be non-sleeping outputs
+ * that are not generating PWM.
+ *
+ * The driver holds two waveforms, one playing and one queued; the queued one
+ * starts right after the last delay of the playing one, so a stream sent as
+ * consecutive waveforms plays without gaps. GPIODRV_IOC_WAVE_QUEUE blocks
+ * while both are taken (or fails with -EAGAIN on an O_NONBLOCK file) and
+ * returns a sequence number in seq; GPIODRV_IOC_WAVE_WAIT blocks until the
+ * waveform with that number has finished.
+ */
+struct gpiodrv_sample {
+	__u32 mask;		/* lines to drive */
+	__u32 value;		/* levels of the lines in mask */
+	__u32 delay_ns;		/* time to the next sample */
+};
+
+struct gpiodrv_wave {
+	__u64 samples;		/* user pointer to struct gpiodrv_sample[count] */
+	__u32 count;
+	__u32 seq;		/* out: sequence number of the waveform */
+};
+
+#define GPIODRV_WAVE_MAX 65536	/* samples per waveform */
+
+/*
+ * Sampling capture on /dev/gpio_capture. While running, a timer samples all
+ * input lines every period_ns and appends one struct gpiodrv_capture_sample
+ * to a ring that user space maps with mmap() (control page at offset 0,
+ * samples at data_offset) or drains with read().
+ *
+ * head and tail count samples and run freely: head - tail samples are
+ * unread and sample n sits at index n & (size - 1). The driver publishes
+ * samples with a release store to head; a consumer frees them with a
+ * release store to tail. When the ring is full new samples are dropped and
+ * counted as overruns. Periods too short for one timer per sample are
+ * sampled in bursts with gaps; the timestamps show them.
+ */
+struct gpiodrv_capture_ctrl {
+	__u32 head;		/* producer position */
+	__u32 pad0[15];
+	__u32 tail;		/* consumer position */
+	__u32 pad1[15];
+	__u32 size;		/* samples in the ring (power of two) */
+	__u32 data_offset;	/* offset of the samples in the mapping */
+	__u32 period_ns;	/* requested sample period */
+	__u32 lines;		/* input lines per sample */
+};
+
+struct gpiodrv_capture_sample {
+	__u32 levels;		/* bit i is input line i */
+	__u32 time_ns;		/* low 32 bits of CLOCK_MONOTONIC in ns */
+};
+
+/*
+ * Asynchronous commands on /dev/gpio_async. write() queues whole
+ * struct gpiodrv_async_cmd records and returns without waiting for the lines
+ * (it blocks only while the queue is full, or fails with -EAGAIN when
+ * O_NONBLOCK). A driver worker applies them in order and queues one
+ * struct gpiodrv_async_done per command, which read() returns. poll()
+ * reports EPOLLIN for completions and EPOLLOUT for room in the queue.
+ *
+ * Consecutive set/clear/toggle commands on disjoint lines are merged into
+ * one update, so lines on one chip (an I2C or SPI expander) change in one
+ * bus transfer. Commands on overlapping lines are never merged, so every
+ * level a command asks for is driven.
+ */
+struct gpiodrv_async_cmd {
+	__u64 tag;		/* returned in the completion */
+	__u32 op;		/* enum gpiodrv_op_code */
+	__u32 mask;
+};
+
+struct gpiodrv_async_done {
+	__u64 tag;
+	__s32 result;		/* 0 or a negative errno */
+	__u32 value;		/* line levels for GPIODRV_OP_GET */
+};
+
+#define GPIODRV_IOC_MAGIC 'G'
+
+#define GPIODRV_IOC_SET _IOW(GPIODRV_IOC_MAGIC, 1, __u32)
+#define GPIODRV_IOC_CLEAR _IOW(GPIODRV_IOC_MAGIC, 2, __u32)
+#define GPIODRV_IOC_TOGGLE _IOW(GPIODRV_IOC_MAGIC, 3, __u32)
+/* Read the level of every line */
+#define GPIODRV_IOC_GET _IOR(GPIODRV_IOC_MAGIC, 4, __u32)
+#define GPIODRV_IOC_SET_DIR _IOW(GPIODRV_IOC_MAGIC, 5, struct gpiodrv_dir)
+#define GPIODRV_IOC_BATCH _IOWR(GPIODRV_IOC_MAGIC, 6, struct gpiodrv_batch)
+#define GPIODRV_IOC_WAVE_QUEUE _IOWR(GPIODRV_IOC_MAGIC, 7, struct gpiodrv_wave)
+/* Wait for the waveform with the given sequence number to finish */
+#define GPIODRV_IOC_WAVE_WAIT _IOW(GPIODRV_IOC_MAGIC, 8, __u32)
+/* Stop playback and drop the queued waveform */
+#define GPIODRV_IOC_WAVE_STOP _IO(GPIODRV_IOC_MAGIC, 9)
+/* On /dev/gpio_capture: empty the ring and start sampling every period_ns */
+#define GPIODRV_IOC_CAPTURE_START _IOW(GPIODRV_IOC_MAGIC, 10, __u32)
+#define GPIODRV_IOC_CAPTURE_STOP _IO(GPIODRV_IOC_MAGIC, 11)
+
+#endif /* GPIODRV_H */
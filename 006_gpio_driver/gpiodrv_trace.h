@@ -0,0 +1,79 @@
+/*
+ * Tracepoints for the gpiodrv file operations. They replace the printk lines
+ * on the open/release/read/write paths: a disabled tracepoint is a patched
+ * out branch, so they cost next to nothing until enabled with
+ *     echo 1 > /sys/kernel/tracing/events/gpiodrv/enable
+ * or recorded with perf record -e 'gpiodrv:*'.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gpiodrv
+
+#if !defined(_GPIODRV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _GPIODRV_TRACE_H
+
+#include <linux/sched.h>
+#include <linux/tracepoint.h>
+
+/* open and release: caller and result */
+DECLARE_EVENT_CLASS(gpiodrv_file,
+	TP_PROTO(int result),
+	TP_ARGS(result),
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(int, result)
+	),
+	TP_fast_assign(
+		__entry->pid = current->pid;
+		__entry->result = result;
+	),
+	TP_printk("pid=%d result=%d", __entry->pid, __entry->result)
+);
+
+DEFINE_EVENT(gpiodrv_file, gpiodrv_open,
+	TP_PROTO(int result),
+	TP_ARGS(result)
+);
+
+DEFINE_EVENT(gpiodrv_file, gpiodrv_release,
+	TP_PROTO(int result),
+	TP_ARGS(result)
+);
+
+/* read and write: caller, requested length, file offset before the call and result */
+DECLARE_EVENT_CLASS(gpiodrv_io,
+	TP_PROTO(size_t len, loff_t offset, ssize_t result),
+	TP_ARGS(len, offset, result),
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(size_t, len)
+		__field(loff_t, offset)
+		__field(ssize_t, result)
+	),
+	TP_fast_assign(
+		__entry->pid = current->pid;
+		__entry->len = len;
+		__entry->offset = offset;
+		__entry->result = result;
+	),
+	TP_printk("pid=%d len=%zu offset=%lld result=%zd", __entry->pid,
+		  __entry->len, __entry->offset, __entry->result)
+);
+
+DEFINE_EVENT(gpiodrv_io, gpiodrv_read,
+	TP_PROTO(size_t len, loff_t offset, ssize_t result),
+	TP_ARGS(len, offset, result)
+);
+
+DEFINE_EVENT(gpiodrv_io, gpiodrv_write,
+	TP_PROTO(size_t len, loff_t offset, ssize_t result),
+	TP_ARGS(len, offset, result)
+);
+
+#endif /* _GPIODRV_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE gpiodrv_trace
+#include <trace/define_trace.h>